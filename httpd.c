@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,11 +10,24 @@
 #include <pthread.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
 
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #define SUCCESS 0
 #define FAIL -1
@@ -20,6 +35,15 @@
 /* epoll 并发规格参数。 */
 #define MAX_EVENTS 10
 
+/* 连接信息表规格参数，以 fd 作为下标。*/
+#define MAX_CONNS 65536
+
+/* Socket I/O 等待超时时间（毫秒）。*/
+#define IO_TIMEOUT_MS 30000
+
+/* HTTP Request Headers 规格参数。*/
+#define MAX_HEADERS 32
+
 
 /**
  * <ctype.h>
@@ -34,6 +58,62 @@
 #define STDOUT 1
 #define STDERR 2
 
+/* 一个 HTTP Request Header，name 和 value 均已去除首尾空白。*/
+struct http_header
+{
+    char name[64];
+    char value[512];
+};
+
+/* 解析后的 HTTP Request（Start line + Headers）。Body 仍然留在 Socket Buffer 中。*/
+struct http_request
+{
+    char method[255];
+    char url[255];      // 原始 URL，包含 query string。
+    char protocol[16];  // e.g. HTTP/1.1
+    int num_headers;
+    struct http_header headers[MAX_HEADERS];
+    long long content_len;  // -1 表示没有 Content-Length。
+    int chunked;            // Transfer-Encoding: chunked
+};
+
+/* 已接受的 Client 连接信息，由 main() 在 accept 时填充。*/
+struct conn_info
+{
+    union
+    {
+        struct sockaddr sa;
+        struct sockaddr_in in;
+        struct sockaddr_in6 in6;
+    } addr;
+    socklen_t addr_len;
+
+    /* 请求追踪：是否被采样，以及 main() 中 accept 和分派线程的时间点（纳秒）。*/
+    int trace_sampled;
+    long long accept_begin_ns;
+    long long accept_end_ns;
+    long long dispatch_ns;
+
+    /* 非 0 表示该 fd 是 CGI 子进程的 pidfd，由 main() 的事件循环回收子进程。*/
+    pid_t cgi_pid;
+
+    /* 连接来自 HTTPS 端口，处理线程需要先完成 TLS 握手。*/
+    int tls;
+
+    /* 请求经由 HTTPS 到达。与 tls 不同，它会随 conn_table 复制到 TLS 桥接和 HTTP/2 Stream 的
+     * socketpair 上，用于 X-Forwarded-Proto。*/
+    int https;
+
+    /* accept 时已经扣除了 Client 级限流的令牌，连接上的第一个 Request 不再重复扣除。*/
+    int ratelimit_charged;
+
+    /* 只有发送方向卸载到 kTLS 的 HTTPS 连接（SSL *）：Request 仍由 OpenSSL 解密，见 conn_recv()。
+     * 其它连接为 NULL。*/
+    void *ssl;
+};
+
+static struct conn_info conn_table[MAX_CONNS];
+
 /**********************************************************************/
 /* Print out an error message with perror() (for system errors; based
  * on value of errno, which indicates system call errors) and exit the
@@ -100,429 +180,5469 @@ int startup_tcp_socket(u_short port)
 }
 
 /**********************************************************************/
-/* 从 Socket Buffer 中读取 HTTP Requeset 中的一行数据。
- * 每调用一次就读取一行，以 \n、\r 或 \r\n 表示 EOL（End of Line）。
- *   - 如果 socket buffer 中读取到 EOL，则转化为 \n\0 结尾。
- *   - 如果 socket buffer 结束但未找到 EOL，则 buff String 以 \0 结尾。
- * Parameters：
- *   - socket fd、buff string、line size。
+/* 获取单调时钟的当前时间（微秒），用于耗时统计。
+ **********************************************************************/
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* 获取单调时钟的当前时间（纳秒），用于请求追踪。*/
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**********************************************************************/
+/* 等待 fd 上的 events 就绪。
  * Returns：
- *   - buff string 的长度，不包括 \0。    
+ *   - > 0 表示就绪，0 表示超时，< 0 表示出错。
  **********************************************************************/
-int get_line(int socket_fd, char *buff, int size)
+static int wait_fd(int fd, short events, int timeout_ms)
 {
-    int i = 0, n = 0;
-    char c = '\0';
+    struct pollfd pfd;
+    int rc;
 
-    /**
-     * 接收指定 Client Socket 发出的数据。
-     * HTTP request start line 总是以 /r/n 结尾。示例：
-normal char: G
-normal char: E
-normal char: T
-normal char:
-normal char: /
-normal char:
-normal char: H
-normal char: T
-normal char: T
-normal char: P
-normal char: /
-normal char: 1
-normal char: .
-normal char: 1
-normal char:
-CLRF char: 0A
-     */
-    while ((c != '\n') && (i < size-1))
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    do
     {
-        n = recv(socket_fd, &c, 1, 0);  // 读取一个字符
-        if (n > 0)
-        {
-            /* CLRF \r\n 组合检测 */
-            if (c == '\r')  // 回车检测，如果是 \r，就继续看看紧跟的是不是 \n？
-            {
-                n = recv(socket_fd, &c, 1, MSG_PEEK);
-                if ((n > 0) && (c == '\n'))  // 换行检测，如果是 \n，那就取出丢弃。
-                    recv(socket_fd, &c, 1, 0);
-                else
-                    c = '\n';
-            }
+        rc = poll(&pfd, 1, timeout_ms);
+    } while ((rc < 0) && (errno == EINTR));
 
-            /* 不是 \n 或 \r\n，那就是有效数据。*/
-            buff[i] = c;
-            i++;
-        }
-        else
+    return rc;
+}
+
+#ifdef ENABLE_TLS
+static ssize_t tls_recv(void *ssl, void *buf, size_t len, int flags);
+static int tls_pending(void *ssl);
+#endif
+
+/* 从 Client 连接读取数据，语义与 recv() 相同。
+ * 发送方向卸载到 kTLS、接收方向没有卸载的连接，由 OpenSSL 读取并解密。*/
+static ssize_t conn_recv(int fd, void *buf, size_t len, int flags)
+{
+#ifdef ENABLE_TLS
+    if ((fd >= 0) && (fd < MAX_CONNS) && (NULL != conn_table[fd].ssl))
+        return tls_recv(conn_table[fd].ssl, buf, len, flags);
+#endif
+    return recv(fd, buf, len, flags);
+}
+
+/* 已经解密、缓冲在 OpenSSL 中的字节数。poll() 看不到这部分数据，等待可读之前需要先检查。*/
+static int conn_pending(int fd)
+{
+#ifdef ENABLE_TLS
+    if ((fd >= 0) && (fd < MAX_CONNS) && (NULL != conn_table[fd].ssl))
+        return tls_pending(conn_table[fd].ssl);
+#endif
+    (void)fd;
+    return 0;
+}
+
+/**********************************************************************/
+/* 兼容非阻塞 fd 的 recv()。
+ * Client Socket 是非阻塞模式，数据没有一次性到达时 recv() 会返回 EAGAIN，
+ * 此时等待数据就绪，而不是把它当成连接结束。
+ * Returns：
+ *   - 读取的字节数，0 表示对端关闭，-1 表示出错或超时。
+ **********************************************************************/
+static ssize_t recv_wait(int fd, void *buf, size_t len, int flags, int timeout_ms)
+{
+    ssize_t n;
+
+    for ( ;; )
+    {
+        n = conn_recv(fd, buf, len, flags);
+        if (n >= 0)
+            return n;
+        if (errno == EINTR)
+            continue;
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+            return -1;
+        if (wait_fd(fd, POLLIN, timeout_ms) <= 0)
+            return -1;
+    }
+}
+
+/**********************************************************************/
+/* 完整发送 len 字节数据，兼容非阻塞 fd。
+ * 使用 MSG_NOSIGNAL，对端提前关闭时返回 FAIL 而不是触发 SIGPIPE。
+ **********************************************************************/
+static int send_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n > 0)
         {
-            /* 没数据了，退出读取。*/
-            c = '\n';
+            p += n;
+            len -= n;
+            continue;
         }
+        if ((n < 0) && (errno == EINTR))
+            continue;
+        if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) &&
+            (wait_fd(fd, POLLOUT, IO_TIMEOUT_MS) > 0))
+            continue;
+        return FAIL;
     }
 
-    buff[i] = '\0';  // Buff String 以 \0 作为读取字符串的结束。
-    return i;
+    return SUCCESS;
 }
 
-/**
- * Inform the client that the requested web method has not been implemented.
- * 
- * HTTP Response Header:
- *  HTTP/1.0 501 Method Not Implemented
- *  Server: jdbhttpd/0.1.0
- *  Content-Type: text/html
- * 
- * HTTP Response Body:
- * <HTML>
- *  <HEAD><TITLE>Method Not Implemented</TITLE></HEAD>
- *  <BODY><P>HTTP request method not supported.</BODY>
- * </HTML>
- */
-void unimplemented(intptr_t cli_socket_fd)
+/**********************************************************************/
+/* 带缓冲的连接读取器，用于按行解析 HTTP 头部后继续流式读取 Body。
+ **********************************************************************/
+struct conn_reader
 {
-    char buff[1024];
-    
-    sprintf(buff, "HTTP/1.0 501 Method Not Implemented\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+    int fd;
+    int timeout_ms;
+    size_t start;
+    size_t end;
+    char buf[8192];
+};
 
-    sprintf(buff, SERVER_STRING);
-    send(cli_socket_fd, buff, strlen(buff), 0);
+static void reader_init(struct conn_reader *r, int fd, int timeout_ms)
+{
+    r->fd = fd;
+    r->timeout_ms = timeout_ms;
+    r->start = 0;
+    r->end = 0;
+}
 
-    sprintf(buff, "Content-Type: text/html\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+/* 读取最多 len 字节：优先消耗缓冲区，缓冲区为空时直接 recv()。*/
+static ssize_t reader_read(struct conn_reader *r, char *out, size_t len)
+{
+    size_t avail = r->end - r->start;
 
-    sprintf(buff, "\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+    if (avail > 0)
+    {
+        if (len > avail)
+            len = avail;
+        memcpy(out, r->buf + r->start, len);
+        r->start += len;
+        return len;
+    }
 
-    sprintf(buff, "<HTML><HEAD><TITLE>Method Not Implemented\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+    return recv_wait(r->fd, out, len, 0, r->timeout_ms);
+}
 
-    sprintf(buff, "</TITLE></HEAD>\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+/**********************************************************************/
+/* 读取一行（包含结尾的 \n），结果以 \0 结尾。
+ * Returns：
+ *   - 行长度；0 表示 EOF；-1 表示出错、超时或行超长。
+ **********************************************************************/
+static int reader_getline(struct conn_reader *r, char *line, size_t size)
+{
+    size_t i = 0;
+    ssize_t n;
+    char *nl;
 
-    sprintf(buff, "<BODY><P>HTTP request method not supported.\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+    for ( ;; )
+    {
+        if (r->start == r->end)
+        {
+            r->start = r->end = 0;
+            n = recv_wait(r->fd, r->buf, sizeof(r->buf), 0, r->timeout_ms);
+            if (n <= 0)
+                return (n == 0 && i == 0) ? 0 : -1;
+            r->end = n;
+        }
 
-    sprintf(buff, "</BODY></HTML>\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+        size_t avail = r->end - r->start;
+        size_t take = avail;
+        nl = memchr(r->buf + r->start, '\n', avail);
+        if (nl)
+            take = nl - (r->buf + r->start) + 1;
+        if (i + take >= size)
+            return -1;
+
+        memcpy(line + i, r->buf + r->start, take);
+        r->start += take;
+        i += take;
+        if (nl)
+        {
+            line[i] = '\0';
+            return i;
+        }
+    }
 }
 
-/**
- * Give a client a 404 not found status message.
- * 
- * HTTP Response Header:
- *  HTTP/1.0 404 NOT FOUND
- *  Server: jdbhttpd/0.1.0
- *  Content-Type: text/html
- * 
- * HTTP Response Body:
- *  <HTML>
- *   <TITLE>Not Found<TITLE>
- *   <BODY><P>The server could not fulfill
- *            your request because the resource specified
- *            is unavailable or nonexistent.
- *   </BODY>
- *  </HTML>
- */
-void not_found(intptr_t cli_socket_fd)
+/**********************************************************************/
+/* 从 reader 向 to_fd 转发 HTTP Body，只使用固定大小的缓冲区。
+ *   - content_len >= 0：按长度转发；
+ *   - chunked：按 chunk 分块转发（原样透传 chunk 编码）；
+ *   - 其他：一直转发到对端关闭。
+ **********************************************************************/
+static int relay_fixed(struct conn_reader *r, int to_fd, long long len)
 {
-    char buff[1024];
+    char buff[8192];
+    ssize_t n;
 
-    sprintf(buff, "HTTP/1.0 404 NOT FOUND\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+    while (len > 0)
+    {
+        n = reader_read(r, buff, (len < (long long)sizeof(buff)) ? (size_t)len : sizeof(buff));
+        if (n <= 0)
+            return FAIL;
+        if (FAIL == send_all(to_fd, buff, n))
+            return FAIL;
+        len -= n;
+    }
 
-    sprintf(buff, SERVER_STRING);
-    send(cli_socket_fd, buff, strlen(buff), 0);
+    return SUCCESS;
+}
 
-    sprintf(buff, "Content-Type: text/html\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+static int relay_body(struct conn_reader *r, int to_fd, long long content_len, int chunked)
+{
+    char line[1024];
+    char buff[8192];
+    ssize_t n;
 
-    sprintf(buff, "\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+    if (chunked)
+    {
+        for ( ;; )
+        {
+            /* chunk-size [; chunk-ext] CRLF */
+            if (reader_getline(r, line, sizeof(line)) <= 0)
+                return FAIL;
+            if (FAIL == send_all(to_fd, line, strlen(line)))
+                return FAIL;
+            long long size = strtoll(line, NULL, 16);
+            if (size < 0)
+                return FAIL;
+            if (0 == size)
+                break;
+            /* chunk-data CRLF */
+            if (FAIL == relay_fixed(r, to_fd, size + 2))
+                return FAIL;
+        }
 
-    sprintf(buff, "<HTML><TITLE>Not Found<TITLE>\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+        /* trailer-part CRLF */
+        do
+        {
+            if (reader_getline(r, line, sizeof(line)) <= 0)
+                return FAIL;
+            if (FAIL == send_all(to_fd, line, strlen(line)))
+                return FAIL;
+        } while (strcmp(line, "\r\n") && strcmp(line, "\n"));
 
-    sprintf(buff, "<BODY><P>The server could not fulfill\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+        return SUCCESS;
+    }
 
-    sprintf(buff, "your request because the resource specified\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+    if (content_len >= 0)
+        return relay_fixed(r, to_fd, content_len);
 
-    sprintf(buff, "is unavailable or nonexistent.\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+    while ((n = reader_read(r, buff, sizeof(buff))) > 0)
+    {
+        if (FAIL == send_all(to_fd, buff, n))
+            return FAIL;
+    }
 
-    sprintf(buff, "</BODY></HTML>\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+    return (0 == n) ? SUCCESS : FAIL;
 }
 
-/**********************************************************************
- * Return the informational HTTP headers about a file.
- * Parameters: the socket to print the headers on
- *             the name of the file */
-/**********************************************************************/
-void send_headers(intptr_t cli_socket_fd, const char *filename)
-{
-    char buff[1024];
-    (void)filename;  // could use filename to determine file type
-
-    sprintf(buff, "HTTP/1.0 200 OK\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+/* Request Body 通过 splice() 转发时，中转 Pipe 的容量。*/
+#define SPLICE_PIPE_SIZE (1024 * 1024)
 
-    sprintf(buff, SERVER_STRING);
-    send(cli_socket_fd, buff, strlen(buff), 0);
+/* 使用普通的 recv()/write() 复制 Body，用于不支持 splice() 的 fd。*/
+static int copy_body(int sock_fd, int to_fd, long long len)
+{
+    char buff[8192];
+    ssize_t n, w;
 
-    sprintf(buff, "Content-Type: text/html\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+    while (len > 0)
+    {
+        n = recv_wait(sock_fd, buff, (len < (long long)sizeof(buff)) ? (size_t)len : sizeof(buff), 0, IO_TIMEOUT_MS);
+        if (n <= 0)
+            return FAIL;
+        len -= n;
+        for (w = 0; w < n; )
+        {
+            ssize_t rc = write(to_fd, buff + w, n - w);
+            if ((rc < 0) && (errno == EINTR))
+                continue;
+            if (rc <= 0)
+                return FAIL;
+            w += rc;
+        }
+    }
 
-    sprintf(buff, "\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+    return SUCCESS;
 }
 
-/**********************************************************************/
-/* Put the entire contents of a file out on a socket.  This function
- * is named after the UNIX "cat" command, because it might have been
- * easier just to do something like pipe, fork, and exec("cat").
- * Parameters: the client socket descriptor
- *             FILE pointer for the file to cat */
-/**********************************************************************/
-void send_contents(intptr_t cli_socket_fd, FILE *resource)
+/* 把 Pipe 中的 len 字节全部 splice() 到 to_fd。*/
+static int drain_pipe(int pipe_fd, int to_fd, ssize_t len)
 {
-    char buff[1024];
+    ssize_t n;
 
-    fgets(buff, sizeof(buff), resource);
-    while (!feof(resource))
+    while (len > 0)
     {
-        send(cli_socket_fd, buff, strlen(buff), 0);
-        fgets(buff, sizeof(buff), resource);
+        n = splice(pipe_fd, NULL, to_fd, NULL, len, SPLICE_F_MOVE);
+        if ((n < 0) && (errno == EINTR))
+            continue;
+        if (n <= 0)
+            return FAIL;
+        len -= n;
     }
+
+    return SUCCESS;
 }
 
 /**********************************************************************/
-/* 向 Client 响应常规 files 请求，会构造 Server Response Headers。
- * Parameters:
- *  - socket fd；
- *  - Client 请求访问的 file path。
+/* 把 Socket 中 len 字节的 Request Body 零拷贝地写入 to_fd。
+ *   - to_fd 是 Pipe（e.g. CGI 的 STDIN）：直接 splice() socket -> pipe；
+ *   - to_fd 是文件：经过中转 Pipe，splice() socket -> pipe -> file。
+ * 数据不经过用户态缓冲区；不支持 splice() 时退回 recv()/write()。
+ * Returns：
+ *   - SUCCESS，或者 Client 提前断开、超时、写入失败时返回 FAIL。
  **********************************************************************/
-void serve_regular_file(intptr_t cli_socket_fd, const char *filename)
+static int splice_body(int sock_fd, int to_fd, long long len)
 {
-    /* 从 Recv buffer 中消耗完 Client Request Headers。*/
-    char buff[1024];
-    buff[0] = 'A';
-    buff[1] = '\0';
-    int num_chars = 1;
-    while ((num_chars > 0) && strcmp(buff, "\n"))  
+    struct stat st;
+    int pipe_fds[2] = { -1, -1 };
+    int via_pipe;
+    int rc = SUCCESS;
+    ssize_t n;
+
+    if (len <= 0)
+        return SUCCESS;
+    if ((sock_fd < MAX_CONNS) && (NULL != conn_table[sock_fd].ssl))
+        return copy_body(sock_fd, to_fd, len);  // Socket 中是 TLS 密文，需要 OpenSSL 解密。
+    if (FAIL == fstat(to_fd, &st))
+        return FAIL;
+
+    via_pipe = !S_ISFIFO(st.st_mode);
+    if (via_pipe)
     {
-        num_chars = get_line(cli_socket_fd, buff, sizeof(buff));
+        if (FAIL == pipe2(pipe_fds, O_CLOEXEC))
+            return copy_body(sock_fd, to_fd, len);
+        fcntl(pipe_fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);  // 失败时沿用默认容量。
     }
+    int out_fd = via_pipe ? pipe_fds[1] : to_fd;
 
-    /* 获取文件内容。*/
-    FILE *resource = fopen(filename, "r");
+    while (len > 0)
+    {
+        size_t chunk = (len < SPLICE_PIPE_SIZE) ? (size_t)len : SPLICE_PIPE_SIZE;
+
+        n = splice(sock_fd, NULL, out_fd, NULL, chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
+        {
+            len -= n;
+            if (via_pipe && (FAIL == drain_pipe(pipe_fds[0], to_fd, n)))
+            {
+                rc = FAIL;
+                break;
+            }
+            continue;
+        }
+        if (0 == n)
+        {
+            rc = FAIL;  // Client 在 Body 传输完之前关闭了连接。
+            break;
+        }
+        if (errno == EINTR)
+            continue;
+        if ((errno == EINVAL) || (errno == ENOSYS))
+        {
+            rc = copy_body(sock_fd, to_fd, len);
+            break;
+        }
+        if (errno != EAGAIN)
+        {
+            rc = FAIL;
+            break;
+        }
+
+        /* Socket 没有数据，或者目标 Pipe 已满（CGI 还没有读取），等待两者都就绪。*/
+        if ((!via_pipe && (wait_fd(out_fd, POLLOUT, IO_TIMEOUT_MS) <= 0)) ||
+            (wait_fd(sock_fd, POLLIN, IO_TIMEOUT_MS) <= 0))
+        {
+            rc = FAIL;
+            break;
+        }
+    }
+
+    if (via_pipe)
+    {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
+
+    return rc;
+}
+
+/**********************************************************************/
+/* 把 Pipe（e.g. CGI 的 STDOUT）中的数据 splice() 到 Socket，直到 EOF。
+ * 数据不经过用户态缓冲区，Socket 启用了 kTLS 时由内核加密；不支持 splice() 时退回 read()/send()。
+ * Returns：
+ *   - SUCCESS，或者 Client 断开、超时时返回 FAIL。
+ **********************************************************************/
+static int splice_output(int pipe_fd, int sock_fd)
+{
+    char buff[4096];
+    ssize_t n;
+
+    for ( ;; )
+    {
+        n = splice(pipe_fd, NULL, sock_fd, NULL, SPLICE_PIPE_SIZE, SPLICE_F_MOVE);
+        if (n > 0)
+            continue;
+        if (0 == n)
+            return SUCCESS;
+        if (errno == EINTR)
+            continue;
+        /* Pipe 是阻塞模式，EAGAIN 只可能来自非阻塞的 Client Socket。*/
+        if ((errno == EAGAIN) && (wait_fd(sock_fd, POLLOUT, IO_TIMEOUT_MS) > 0))
+            continue;
+        if ((errno == EINVAL) || (errno == ENOSYS))
+            break;
+        return FAIL;
+    }
+
+    while ((n = read(pipe_fd, buff, sizeof(buff))) > 0)
+    {
+        if (FAIL == send_all(sock_fd, buff, n))
+            return FAIL;
+    }
+
+    return SUCCESS;
+}
+
+/*************************
+ * TRACING
+ *************************/
+
+/* 请求追踪规格参数。*/
+#define TRACE_DEFAULT_SAMPLE_RATE 0                    // 每 N 个请求采样 1 个，0 表示关闭；可由环境变量 HTTPD_TRACE_SAMPLE 覆盖。
+#define TRACE_RING_SIZE           4096                 // 全局环形缓冲区保留的请求数量。
+#define TRACE_MAX_SPANS           16                   // 每个请求最多记录的 span 数量。
+#define TRACE_DUMP_FILE           "httpd-trace.json"   // 收到 SIGUSR1 时导出的文件。
+
+/* USDT 探针：make httpd-usdt 时启用，可被 perf / bpftrace 挂载，
+ * e.g. bpftrace -e 'usdt:./httpd:httpd:phase_end { @[arg1] = count(); }' */
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+#define USDT_PROBE(name, phase) DTRACE_PROBE1(httpd, name, phase)
+#else
+#define USDT_PROBE(name, phase) do { } while (0)
+#endif
+
+/* 请求处理的各个阶段。*/
+enum trace_phase
+{
+    TRACE_REQUEST = 0,      // 整个请求，由处理线程开始到关闭连接。
+    TRACE_ACCEPT,           // accept() 系统调用。
+    TRACE_WAIT_DATA,        // accept 之后等待 Request 数据到达（epoll）。
+    TRACE_THREAD_SPAWN,     // pthread_create() 到处理线程开始运行。
+    TRACE_READ_REQUEST,     // get_line() 读取 Start line 和 Headers。
+    TRACE_STAT,             // stat() 请求的文件。
+    TRACE_OPEN_FILE,        // fopen() 静态文件。
+    TRACE_SEND_FILE,        // sendfile() 发送静态文件。
+    TRACE_CGI_SPAWN,        // 创建 CGI 子进程。
+    TRACE_CGI_BODY,         // 向 CGI 写入 Request Body。
+    TRACE_CGI_OUTPUT,       // 读取 CGI 输出并响应。
+    TRACE_CGI_WAIT,         // 同步 waitpid() 回收 CGI 子进程（微缓存，或者 pidfd 不可用时）。
+    TRACE_CACHE_WAIT,       // 微缓存请求合并时等待 in-flight CGI。
+    TRACE_PROXY_CONNECT,    // 获取 upstream 连接。
+    TRACE_PROXY,            // 反向代理转发。
+    TRACE_UPLOAD,           // 上传文件：接收 Request Body 并写入磁盘。
+    TRACE_TLS_HANDSHAKE,    // HTTPS 连接的 TLS 握手。
+    TRACE_NUM_PHASES
+};
+
+static const char *trace_phase_names[TRACE_NUM_PHASES] = {
+    "request", "accept", "wait_data", "thread_spawn", "read_request", "stat",
+    "open_file", "send_file", "cgi_spawn", "cgi_body", "cgi_output", "cgi_wait",
+    "cache_wait", "proxy_connect", "proxy", "upload", "tls_handshake",
+};
+
+struct trace_span
+{
+    int phase;
+    long long begin_ns;
+    long long end_ns;
+};
+
+/* 一个被采样请求的追踪记录。*/
+struct trace_record
+{
+    unsigned long long seq;  // seqlock：奇数表示正在写入，偶数表示写入完成。
+    unsigned int req_id;
+    int tid;
+    int num_spans;
+    char url[64];
+    struct trace_span spans[TRACE_MAX_SPANS];
+};
+
+/* 处理线程私有的追踪上下文，请求结束时一次性发布到全局环形缓冲区。*/
+struct trace_ctx
+{
+    struct trace_record rec;
+    int open[TRACE_NUM_PHASES];
+};
+
+static int trace_sample_rate = TRACE_DEFAULT_SAMPLE_RATE;
+static unsigned int trace_seq;                         // 只在 main() 线程中访问。
+static unsigned long long trace_head;                  // 环形缓冲区写入位置，原子递增。
+static struct trace_record trace_ring[TRACE_RING_SIZE];
+static __thread struct trace_ctx *trace_cur;           // 当前线程正在追踪的请求，NULL 表示未采样。
+
+static void trace_span_add(int phase, long long begin_ns, long long end_ns)
+{
+    struct trace_record *rec = &trace_cur->rec;
+
+    if (rec->num_spans >= TRACE_MAX_SPANS)
+        return;
+    trace_cur->open[phase] = rec->num_spans;
+    rec->spans[rec->num_spans].phase = phase;
+    rec->spans[rec->num_spans].begin_ns = begin_ns;
+    rec->spans[rec->num_spans].end_ns = end_ns;
+    rec->num_spans++;
+}
+
+static void trace_begin(int phase)
+{
+    trace_span_add(phase, now_ns(), 0);
+}
+
+static void trace_end(int phase)
+{
+    int i = trace_cur->open[phase];
+
+    if ((i >= 0) && (i < trace_cur->rec.num_spans) && (0 == trace_cur->rec.spans[i].end_ns))
+        trace_cur->rec.spans[i].end_ns = now_ns();
+}
+
+/* 在处理函数中标记阶段的开始和结束，未采样时只有一次 TLS 判空的开销。*/
+#define TRACE_BEGIN(phase)                          \
+    do                                              \
+    {                                               \
+        USDT_PROBE(phase_begin, phase);             \
+        if (NULL != trace_cur)                      \
+            trace_begin(phase);                     \
+    } while (0)
+
+#define TRACE_END(phase)                            \
+    do                                              \
+    {                                               \
+        USDT_PROBE(phase_end, phase);               \
+        if (NULL != trace_cur)                      \
+            trace_end(phase);                       \
+    } while (0)
+
+/* 由 main() 在 accept 之后调用：决定是否采样此连接。*/
+static int trace_should_sample(void)
+{
+    return (trace_sample_rate > 0) && (0 == (++trace_seq % trace_sample_rate));
+}
+
+/**********************************************************************/
+/* 处理线程开始时调用：如果连接被采样，初始化线程私有的追踪上下文，
+ * 并补记 main() 中发生的 accept、等待数据和线程创建阶段。
+ **********************************************************************/
+static void trace_request_begin(struct trace_ctx *ctx, int socket_fd)
+{
+    static unsigned int next_req_id;
+    struct conn_info *conn;
+    int i;
+
+    trace_cur = NULL;
+    if ((socket_fd < 0) || (socket_fd >= MAX_CONNS) || !conn_table[socket_fd].trace_sampled)
+        return;
+    conn = &conn_table[socket_fd];
+    conn->trace_sampled = 0;
+
+    memset(&ctx->rec, 0, sizeof(ctx->rec));
+    for (i = 0; i < TRACE_NUM_PHASES; i++)
+        ctx->open[i] = -1;
+    ctx->rec.req_id = __atomic_add_fetch(&next_req_id, 1, __ATOMIC_RELAXED);
+    ctx->rec.tid = (int)syscall(SYS_gettid);
+    trace_cur = ctx;
+
+    long long start_ns = now_ns();
+    trace_span_add(TRACE_REQUEST, conn->accept_begin_ns, 0);
+    trace_span_add(TRACE_ACCEPT, conn->accept_begin_ns, conn->accept_end_ns);
+    trace_span_add(TRACE_WAIT_DATA, conn->accept_end_ns, conn->dispatch_ns);
+    trace_span_add(TRACE_THREAD_SPAWN, conn->dispatch_ns, start_ns);
+}
+
+/* 记录被追踪请求的 URL。*/
+static void trace_set_url(const char *url)
+{
+    if (NULL != trace_cur)
+        snprintf(trace_cur->rec.url, sizeof(trace_cur->rec.url), "%s", url);
+}
+
+/**********************************************************************/
+/* 处理线程结束时调用：把追踪记录发布到全局环形缓冲区。
+ * 写入位置通过原子递增获取，每个槽位用 seqlock 保护，写入过程不加锁。
+ * 环形缓冲区回绕后，两个写者可能落到同一个槽位：写者先把 seq 从观察到的偶数 CAS 为奇数
+ * 来独占槽位，槽位正在被写入、或者已经被更新的记录占用时直接丢弃本条记录，避免发布撕裂的记录。
+ **********************************************************************/
+static void trace_request_end(void)
+{
+    struct trace_ctx *ctx = trace_cur;
+
+    if (NULL == ctx)
+        return;
+    trace_end(TRACE_REQUEST);
+    trace_cur = NULL;
+
+    unsigned long long idx = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    struct trace_record *slot = &trace_ring[idx % TRACE_RING_SIZE];
+    unsigned long long seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+
+    if ((seq & 1) || (seq > idx * 2) ||
+        !__atomic_compare_exchange_n(&slot->seq, &seq, idx * 2 + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char *)slot + sizeof(slot->seq), (char *)&ctx->rec + sizeof(ctx->rec.seq),
+           sizeof(*slot) - sizeof(slot->seq));
+    __atomic_store_n(&slot->seq, idx * 2 + 2, __ATOMIC_RELEASE);
+}
+
+/**********************************************************************/
+/* 以 Chrome trace（Trace Event Format）JSON 格式导出环形缓冲区中的记录，
+ * 可以直接用 chrome://tracing 或 ui.perfetto.dev 打开。
+ * 正在被写入或者在读取过程中被覆盖的记录会被跳过。
+ **********************************************************************/
+static void trace_dump(FILE *out)
+{
+    static struct trace_record rec;  // 只在持有 dump_lock 时使用，避免占用线程栈。
+    static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+    unsigned long long head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    unsigned long long idx = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+    int pid = getpid();
+    int first = 1;
+    int i;
+
+    pthread_mutex_lock(&dump_lock);
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for ( ; idx < head; idx++)
+    {
+        struct trace_record *slot = &trace_ring[idx % TRACE_RING_SIZE];
+        unsigned long long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq != idx * 2 + 2)
+            continue;
+        memcpy(&rec, slot, sizeof(rec));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+
+        for (i = 0; i < rec.num_spans; i++)
+        {
+            const struct trace_span *span = &rec.spans[i];
+            long long end_ns = span->end_ns ? span->end_ns : span->begin_ns;
+            const char *c;
+
+            fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"httpd\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"req\":%u,\"url\":\"",
+                    first ? "" : ",", trace_phase_names[span->phase], pid, rec.tid,
+                    span->begin_ns / 1000.0, (end_ns - span->begin_ns) / 1000.0, rec.req_id);
+            for (c = rec.url; *c; c++)
+            {
+                if (('"' == *c) || ('\\' == *c))
+                    fputc('\\', out);
+                if ((unsigned char)*c >= 0x20)
+                    fputc(*c, out);
+            }
+            fprintf(out, "\"}}");
+            first = 0;
+        }
+    }
+    fprintf(out, "\n]}\n");
+    pthread_mutex_unlock(&dump_lock);
+}
+
+/* 收到 SIGUSR1 时由 main() 调用，把追踪记录导出到 TRACE_DUMP_FILE。*/
+static void trace_dump_file(void)
+{
+    FILE *out = fopen(TRACE_DUMP_FILE, "w");
+
+    if (NULL == out)
+    {
+        perror("Open trace dump file failed");
+        return;
+    }
+    trace_dump(out);
+    fclose(out);
+    printf("Trace dumped to %s\n", TRACE_DUMP_FILE);
+}
+
+/* 状态页面：以 Chrome trace JSON 格式输出追踪记录。*/
+void trace_status(intptr_t cli_socket_fd)
+{
+    char *json = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&json, &len);
+
+    if (NULL == out)
+        return;
+    trace_dump(out);
+    fclose(out);
+    send_all(cli_socket_fd, json, len);
+    free(json);
+}
+
+/**********************************************************************/
+/* 从 Socket Buffer 中读取 HTTP Requeset 中的一行数据。
+ * 每调用一次就读取一行，以 \n、\r 或 \r\n 表示 EOL（End of Line）。
+ *   - 如果 socket buffer 中读取到 EOL，则转化为 \n\0 结尾。
+ *   - 如果 socket buffer 结束但未找到 EOL，则 buff String 以 \0 结尾。
+ * Parameters：
+ *   - socket fd、buff string、line size。
+ * Returns：
+ *   - buff string 的长度，不包括 \0。    
+ **********************************************************************/
+int get_line(int socket_fd, char *buff, int size)
+{
+    int i = 0, n = 0;
+    char c = '\0';
+
+    /**
+     * 接收指定 Client Socket 发出的数据。
+     * HTTP request start line 总是以 /r/n 结尾。示例：
+normal char: G
+normal char: E
+normal char: T
+normal char:
+normal char: /
+normal char:
+normal char: H
+normal char: T
+normal char: T
+normal char: P
+normal char: /
+normal char: 1
+normal char: .
+normal char: 1
+normal char:
+CLRF char: 0A
+     */
+    while ((c != '\n') && (i < size-1))
+    {
+        n = recv_wait(socket_fd, &c, 1, 0, IO_TIMEOUT_MS);  // 读取一个字符
+        if (n > 0)
+        {
+            /* CLRF \r\n 组合检测 */
+            if (c == '\r')  // 回车检测，如果是 \r，就继续看看紧跟的是不是 \n？
+            {
+                n = recv_wait(socket_fd, &c, 1, MSG_PEEK, IO_TIMEOUT_MS);
+                if ((n > 0) && (c == '\n'))  // 换行检测，如果是 \n，那就取出丢弃。
+                    conn_recv(socket_fd, &c, 1, 0);
+                else
+                    c = '\n';
+            }
+
+            /* 不是 \n 或 \r\n，那就是有效数据。*/
+            buff[i] = c;
+            i++;
+        }
+        else
+        {
+            /* 没数据了，退出读取。*/
+            c = '\n';
+        }
+    }
+
+    buff[i] = '\0';  // Buff String 以 \0 作为读取字符串的结束。
+    return i;
+}
+
+/**********************************************************************/
+/* 读取全部 HTTP Request Headers，直到空行为止，并记录 Body 的长度信息。
+ * 超出 MAX_HEADERS 的 Header 会被读取并丢弃。
+ * Parameters：
+ *   - socket fd、待填充的 request。
+ **********************************************************************/
+void read_request_headers(int socket_fd, struct http_request *req)
+{
+    char buff[1024];
+    int num_chars;
+
+    req->num_headers = 0;
+    req->content_len = -1;
+    req->chunked = 0;
+
+    num_chars = get_line(socket_fd, buff, sizeof(buff));
+    while ((num_chars > 0) && strcmp(buff, "\n"))
+    {
+        char *colon = strchr(buff, ':');
+        if ((NULL != colon) && (req->num_headers < MAX_HEADERS))
+        {
+            struct http_header *hdr = &req->headers[req->num_headers];
+            char *value = colon + 1;
+            char *end;
+
+            *colon = '\0';
+            while (IS_SPACE(*value))
+                value++;
+            end = value + strlen(value);
+            while ((end > value) && IS_SPACE(end[-1]))
+                *--end = '\0';
+
+            hdr->name[0] = '\0';
+            strncat(hdr->name, buff, sizeof(hdr->name) - 1);
+            hdr->value[0] = '\0';
+            strncat(hdr->value, value, sizeof(hdr->value) - 1);
+            req->num_headers++;
+
+            if (0 == strcasecmp(hdr->name, "Content-Length"))
+                req->content_len = atoll(hdr->value);
+            else if ((0 == strcasecmp(hdr->name, "Transfer-Encoding")) && strcasestr(hdr->value, "chunked"))
+                req->chunked = 1;
+        }
+
+        num_chars = get_line(socket_fd, buff, sizeof(buff));
+    }
+}
+
+/**********************************************************************/
+/* 原地规范化 URL 的路径部分，Query String 保持不变：
+ * 合并连续的 '/'，去掉 "." 段，e.g. //a/./b.cgi?x -> /a/b.cgi?x。
+ * 限流、微缓存、反向代理等按前缀匹配的规则都以规范化后的路径为准，
+ * 同一个文件不能通过不同的写法绕过这些规则。
+ * Returns：
+ *   - SUCCESS，路径中含有 ".." 段时返回 FAIL。
+ **********************************************************************/
+int normalize_url(char *url)
+{
+    char *in = url;
+    char *out = url;
+
+    if ('/' != *url)
+        return SUCCESS;
+
+    while ('/' == *in)
+    {
+        while ('/' == *in)
+            in++;
+        char *seg = in;
+        while (*in && ('/' != *in) && ('?' != *in))
+            in++;
+        size_t seg_len = in - seg;
+
+        if ((2 == seg_len) && (0 == strncmp(seg, "..", 2)))
+            return FAIL;
+        if ((1 == seg_len) && ('.' == *seg))
+        {
+            if ('/' != *in)
+                *out++ = '/';  // 结尾的 "." 段等价于目录本身，e.g. /a/. -> /a/
+            continue;
+        }
+        *out++ = '/';
+        memmove(out, seg, seg_len);
+        out += seg_len;
+    }
+    memmove(out, in, strlen(in) + 1);
+
+    return SUCCESS;
+}
+
+/* 查找指定名称的 Request Header，不区分大小写。没有找到时返回 NULL。*/
+const char *get_header(const struct http_request *req, const char *name)
+{
+    int i;
+
+    for (i = 0; i < req->num_headers; i++)
+    {
+        if (0 == strcasecmp(req->headers[i].name, name))
+            return req->headers[i].value;
+    }
+
+    return NULL;
+}
+
+/* 将 Client Socket fd 对应的对端地址格式化为数字形式的 IP 字符串。*/
+void conn_client_addr(int socket_fd, char *host, size_t size)
+{
+    if ((socket_fd < 0) || (socket_fd >= MAX_CONNS) || (0 == conn_table[socket_fd].addr_len) ||
+        (SUCCESS != getnameinfo(&conn_table[socket_fd].addr.sa, conn_table[socket_fd].addr_len,
+                                host, size, NULL, 0, NI_NUMERICHOST)))
+    {
+        snprintf(host, size, "-");
+    }
+}
+
+/**
+ * Inform the client that the requested web method has not been implemented.
+ * 
+ * HTTP Response Header:
+ *  HTTP/1.0 501 Method Not Implemented
+ *  Server: jdbhttpd/0.1.0
+ *  Content-Type: text/html
+ * 
+ * HTTP Response Body:
+ * <HTML>
+ *  <HEAD><TITLE>Method Not Implemented</TITLE></HEAD>
+ *  <BODY><P>HTTP request method not supported.</BODY>
+ * </HTML>
+ */
+void unimplemented(intptr_t cli_socket_fd)
+{
+    char buff[1024];
+    
+    sprintf(buff, "HTTP/1.0 501 Method Not Implemented\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, SERVER_STRING);
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, "Content-Type: text/html\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, "\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, "<HTML><HEAD><TITLE>Method Not Implemented\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, "</TITLE></HEAD>\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, "<BODY><P>HTTP request method not supported.\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, "</BODY></HTML>\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+}
+
+/**
+ * Give a client a 404 not found status message.
+ * 
+ * HTTP Response Header:
+ *  HTTP/1.0 404 NOT FOUND
+ *  Server: jdbhttpd/0.1.0
+ *  Content-Type: text/html
+ * 
+ * HTTP Response Body:
+ *  <HTML>
+ *   <TITLE>Not Found<TITLE>
+ *   <BODY><P>The server could not fulfill
+ *            your request because the resource specified
+ *            is unavailable or nonexistent.
+ *   </BODY>
+ *  </HTML>
+ */
+void not_found(intptr_t cli_socket_fd)
+{
+    char buff[1024];
+
+    sprintf(buff, "HTTP/1.0 404 NOT FOUND\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, SERVER_STRING);
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, "Content-Type: text/html\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, "\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, "<HTML><TITLE>Not Found<TITLE>\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, "<BODY><P>The server could not fulfill\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, "your request because the resource specified\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, "is unavailable or nonexistent.\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, "</BODY></HTML>\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+}
+
+/**********************************************************************
+ * Return the informational HTTP headers about a file.
+ * Parameters: the socket to print the headers on
+ *             the name of the file */
+/**********************************************************************/
+void send_headers(intptr_t cli_socket_fd, const char *filename)
+{
+    char buff[1024];
+    (void)filename;  // could use filename to determine file type
+
+    sprintf(buff, "HTTP/1.0 200 OK\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, SERVER_STRING);
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, "Content-Type: text/html\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, "\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+}
+
+/**********************************************************************/
+/* Put the entire contents of a file out on a socket.  This function
+ * is named after the UNIX "cat" command, because it might have been
+ * easier just to do something like pipe, fork, and exec("cat").
+ * Parameters: the client socket descriptor
+ *             FILE pointer for the file to cat */
+/**********************************************************************/
+void send_contents(intptr_t cli_socket_fd, FILE *resource)
+{
+    char buff[4096];
+    int file_fd = fileno(resource);
+    off_t offset = 0;
+    ssize_t n;
+
+    /* sendfile() 在内核中把 Page Cache 直接交给 Socket，不经过用户态缓冲区；
+     * Socket 启用了 kTLS 时由内核加密，同样是零拷贝。*/
+    for ( ;; )
+    {
+        n = sendfile(cli_socket_fd, file_fd, &offset, SPLICE_PIPE_SIZE);
+        if (n > 0)
+            continue;
+        if (0 == n)
+            return;
+        if (errno == EINTR)
+            continue;
+        if ((errno == EAGAIN) && (wait_fd(cli_socket_fd, POLLOUT, IO_TIMEOUT_MS) > 0))
+            continue;
+        if ((errno == EINVAL) || (errno == ENOSYS))
+            break;
+        return;
+    }
+
+    /* 不支持 sendfile() 的 fd，退回 read()/send()。*/
+    lseek(file_fd, offset, SEEK_SET);
+    while ((n = read(file_fd, buff, sizeof(buff))) > 0)
+    {
+        if (FAIL == send_all(cli_socket_fd, buff, n))
+            break;
+    }
+}
+
+/**********************************************************************/
+/* 向 Client 响应常规 files 请求，会构造 Server Response Headers。
+ * Parameters:
+ *  - socket fd；
+ *  - Client 请求访问的 file path。
+ **********************************************************************/
+void serve_regular_file(intptr_t cli_socket_fd, const char *filename)
+{
+    /* 获取文件内容。Client Request Headers 已经在 request_handle() 中读取完毕。*/
+    TRACE_BEGIN(TRACE_OPEN_FILE);
+    FILE *resource = fopen(filename, "r");
+    TRACE_END(TRACE_OPEN_FILE);
     if (NULL == resource)
     {
-        not_found(cli_socket_fd);
+        not_found(cli_socket_fd);
+    }
+    else
+    {
+        TRACE_BEGIN(TRACE_SEND_FILE);
+        // 响应 Header
+        send_headers(cli_socket_fd, filename);
+        // 响应 File Content
+        send_contents(cli_socket_fd, resource);
+        fclose(resource);
+        TRACE_END(TRACE_SEND_FILE);
+    }
+}
+
+/**********************************************************************/
+/* Inform the client that a request it has made has a problem.
+ * Parameters: client socket */
+/**********************************************************************/
+void bad_request(intptr_t cli_socket_fd)
+{
+    char buff[1024];
+
+    sprintf(buff, "HTTP/1.0 400 BAD REQUEST\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, "Content-Type: text/html\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, "\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, "<P>Your browser sent a bad request, ");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, "such as a POST without a Content-Length.\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+}
+
+/**********************************************************************/
+/* Inform the client that a CGI script could not be executed.
+ * Parameter: the client socket descriptor. */
+/**********************************************************************/
+void cannot_execute(intptr_t cli_socket_fd)
+{
+    char buff[1024];
+
+    sprintf(buff, "HTTP/1.0 500 Internal Server Error\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, "Content-Type: text/html\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, "\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    sprintf(buff, "<P>Error prohibited CGI execution.\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+}
+
+/**********************************************************************/
+/* Inform the client that the service is temporarily unavailable
+ * (no healthy upstream server, or the CGI spawn queue is full).
+ * Parameter: the client socket descriptor. */
+/**********************************************************************/
+void service_unavailable(intptr_t cli_socket_fd)
+{
+    char buff[1024];
+
+    sprintf(buff, "HTTP/1.0 503 Service Unavailable\r\n");
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+
+    sprintf(buff, SERVER_STRING);
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+
+    sprintf(buff, "Content-Type: text/html\r\n");
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+
+    sprintf(buff, "\r\n");
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+
+    sprintf(buff, "<P>The service is temporarily unavailable.\r\n");
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+}
+
+/* CGI 子进程并发规格参数。*/
+#define CGI_MAX_CHILDREN  32    // 同时运行的 CGI 子进程上限。
+#define CGI_MAX_QUEUE     64    // 等待启动的请求上限，超出时直接返回 503。
+#define CGI_MAX_ENV       (MAX_HEADERS + 16)
+
+/* CGI 子进程并发控制和运行时指标。*/
+struct cgi_limiter
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int running;                // 已启动但尚未回收的子进程数。
+    int waiting;                // 正在排队的请求数。
+    unsigned long spawned;
+    unsigned long queued;
+    unsigned long rejected;
+    unsigned long reaped_async; // 由 main() 事件循环通过 pidfd 回收的子进程数。
+};
+
+static struct cgi_limiter cgi_limiter = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* 所有 CGI 请求共用的环境变量，由 cgi_init() 预先生成。*/
+static char cgi_base_env[4][4096];
+static int cgi_epoll_fd = -1;
+
+/* 初始化 CGI 公共环境变量，并记录用于回收子进程的 epoll 实例。*/
+void cgi_init(int epoll_fd, u_short port)
+{
+    const char *path = getenv("PATH");
+
+    snprintf(cgi_base_env[0], sizeof(cgi_base_env[0]), "SERVER_SOFTWARE=%.*s",
+             (int)strlen(SERVER_STRING) - 10, SERVER_STRING + 8);  // "Server: xxx\r\n"
+    snprintf(cgi_base_env[1], sizeof(cgi_base_env[1]), "GATEWAY_INTERFACE=CGI/1.1");
+    snprintf(cgi_base_env[2], sizeof(cgi_base_env[2]), "SERVER_PORT=%d", port);
+    snprintf(cgi_base_env[3], sizeof(cgi_base_env[3]), "PATH=%s", path ? path : "/usr/local/bin:/usr/bin:/bin");
+    cgi_epoll_fd = epoll_fd;
+}
+
+/* 占用一个子进程名额，名额用完时排队等待。Returns：SUCCESS，队列已满或等待超时返回 FAIL。*/
+static int cgi_slot_acquire(void)
+{
+    struct timespec deadline;
+    int rc = SUCCESS;
+
+    pthread_mutex_lock(&cgi_limiter.lock);
+    if ((cgi_limiter.running >= CGI_MAX_CHILDREN) && (cgi_limiter.waiting >= CGI_MAX_QUEUE))
+    {
+        cgi_limiter.rejected++;
+        pthread_mutex_unlock(&cgi_limiter.lock);
+        return FAIL;
+    }
+    if (cgi_limiter.running >= CGI_MAX_CHILDREN)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += IO_TIMEOUT_MS / 1000;
+        cgi_limiter.waiting++;
+        cgi_limiter.queued++;
+        while ((SUCCESS == rc) && (cgi_limiter.running >= CGI_MAX_CHILDREN))
+        {
+            if (ETIMEDOUT == pthread_cond_timedwait(&cgi_limiter.cond, &cgi_limiter.lock, &deadline))
+                rc = FAIL;
+        }
+        cgi_limiter.waiting--;
+    }
+    if (SUCCESS == rc)
+        cgi_limiter.running++;
+    else
+        cgi_limiter.rejected++;
+    pthread_mutex_unlock(&cgi_limiter.lock);
+
+    return rc;
+}
+
+/* 子进程已回收，归还名额并唤醒一个排队的请求。*/
+static void cgi_slot_release(int async)
+{
+    pthread_mutex_lock(&cgi_limiter.lock);
+    cgi_limiter.running--;
+    if (async)
+        cgi_limiter.reaped_async++;
+    pthread_cond_signal(&cgi_limiter.cond);
+    pthread_mutex_unlock(&cgi_limiter.lock);
+}
+
+/* 子进程的环境变量：所有字符串依次存放在 buff 中。*/
+struct cgi_env
+{
+    char *vars[CGI_MAX_ENV + 1];
+    int count;
+    size_t used;
+    char buff[8192];
+};
+
+static void cgi_env_add(struct cgi_env *env, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (env->count >= CGI_MAX_ENV)
+        return;
+    va_start(ap, fmt);
+    n = vsnprintf(env->buff + env->used, sizeof(env->buff) - env->used, fmt, ap);
+    va_end(ap);
+    if ((n < 0) || ((size_t)n >= sizeof(env->buff) - env->used))
+        return;  // 放不下的变量直接丢弃。
+
+    env->vars[env->count++] = env->buff + env->used;
+    env->vars[env->count] = NULL;
+    env->used += n + 1;
+}
+
+/**********************************************************************/
+/* 生成 CGI/1.1 环境变量（RFC 3875）：
+ *   - cgi_init() 预先生成的 SERVER_SOFTWARE、GATEWAY_INTERFACE、SERVER_PORT、PATH；
+ *   - Request 相关的 REQUEST_METHOD、QUERY_STRING、CONTENT_*、SCRIPT_*、REMOTE_*；
+ *   - 每个 Request Header 对应一个 HTTP_* 变量。
+ **********************************************************************/
+static void cgi_build_env(struct cgi_env *env, intptr_t cli_socket_fd, const struct http_request *req,
+                          const char *path, const char *query_str)
+{
+    const char *value;
+    char host[NI_MAXHOST], serv[NI_MAXSERV];
+    int i;
+
+    env->count = 0;
+    env->used = 0;
+    env->vars[0] = NULL;
+    for (i = 0; i < (int)(sizeof(cgi_base_env) / sizeof(cgi_base_env[0])); i++)
+        cgi_env_add(env, "%s", cgi_base_env[i]);
+
+    cgi_env_add(env, "REQUEST_METHOD=%s", req->method);
+    cgi_env_add(env, "SERVER_PROTOCOL=%s", req->protocol[0] ? req->protocol : "HTTP/1.0");
+    cgi_env_add(env, "QUERY_STRING=%s", query_str ? query_str : "");
+    cgi_env_add(env, "SCRIPT_NAME=%s", path + strlen("htdocs"));
+    cgi_env_add(env, "SCRIPT_FILENAME=%s", path);
+    if (req->content_len >= 0)
+        cgi_env_add(env, "CONTENT_LENGTH=%lld", req->content_len);
+    if (NULL != (value = get_header(req, "Content-Type")))
+        cgi_env_add(env, "CONTENT_TYPE=%s", value);
+    if (NULL != (value = get_header(req, "Host")))
+        cgi_env_add(env, "SERVER_NAME=%.*s", (int)strcspn(value, ":"), value);
+
+    if ((cli_socket_fd >= 0) && (cli_socket_fd < MAX_CONNS) && (0 != conn_table[cli_socket_fd].addr_len) &&
+        (SUCCESS == getnameinfo(&conn_table[cli_socket_fd].addr.sa, conn_table[cli_socket_fd].addr_len,
+                                host, sizeof(host), serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV)))
+    {
+        cgi_env_add(env, "REMOTE_ADDR=%s", host);
+        cgi_env_add(env, "REMOTE_PORT=%s", serv);
+    }
+
+    for (i = 0; i < req->num_headers; i++)
+    {
+        const struct http_header *hdr = &req->headers[i];
+        char name[sizeof(hdr->name)];
+        size_t j;
+
+        /* Content-Length/Type 已经有对应的变量；HTTP_PROXY 会被 CGI 程序误当作代理设置（httpoxy）。*/
+        if ((0 == strcasecmp(hdr->name, "Content-Length")) || (0 == strcasecmp(hdr->name, "Content-Type")) ||
+            (0 == strcasecmp(hdr->name, "Proxy")))
+            continue;
+        for (j = 0; hdr->name[j]; j++)
+            name[j] = ('-' == hdr->name[j]) ? '_' : toupper((unsigned char)hdr->name[j]);
+        name[j] = '\0';
+        cgi_env_add(env, "HTTP_%s=%s", name, hdr->value);
+    }
+}
+
+/**********************************************************************/
+/* 创建子进程执行 CGI 程序。
+ * Pipeline 数据流：
+ *  in_fd -> cgi_input[0] -> STDIN -> STDOUT -> cgi_output[1] -> out_fd
+ * 使用 posix_spawn()（glibc 以 CLONE_VM | CLONE_VFORK 实现），
+ * 不需要像 fork() 那样复制整个多线程进程的页表。
+ * 同时运行的子进程数受 CGI_MAX_CHILDREN 限制，调用者必须通过
+ * cgi_reap() 或 cgi_reap_async() 回收子进程并归还名额。
+ * Parameters：
+ *   - Client Socket fd（用于 REMOTE_ADDR，后台任务为 -1）、request、CGI 程序路径、query string；
+ *   - 返回给调用者的 in_fd（写入 Request Body）和 out_fd（读取 CGI 输出）。
+ * Returns：
+ *   - 子进程 pid，失败返回 FAIL；排队已满或等待超时时 errno 为 EAGAIN。
+ **********************************************************************/
+static pid_t cgi_spawn(intptr_t cli_socket_fd, const struct http_request *req, const char *path,
+                       const char *query_str, int *in_fd, int *out_fd)
+{
+    if (FAIL == cgi_slot_acquire())
+    {
+        errno = EAGAIN;
+        return FAIL;
+    }
+
+    /* 创建 In/Out 两个 Pipe，用于父子进程间通信。
+     * O_CLOEXEC：避免并发执行的其他 CGI 子进程继承这些 Pipe，导致读不到 EOF。
+     * dup2() 到 STDIN/STDOUT 之后的 fd 不再带有 O_CLOEXEC。*/
+    int cgi_input[2];   // 0：输出端，1：输入端。
+    int cgi_output[2];  // 0：输出端，1：输入端。
+    if (pipe2(cgi_input, O_CLOEXEC) < 0)   // Input Pipe
+    {
+        cgi_slot_release(0);
+        return FAIL;
+    }
+    if (pipe2(cgi_output, O_CLOEXEC) < 0)  // Output Pipe
+    {
+        close(cgi_input[0]);
+        close(cgi_input[1]);
+        cgi_slot_release(0);
+        return FAIL;
+    }
+
+    /* 管道重定向：cgi_input[0] -> STDIN -> STDOUT -> cgi_output[1] */
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, cgi_input[0], STDIN);
+    posix_spawn_file_actions_adddup2(&actions, cgi_output[1], STDOUT);
+
+    /* 恢复 main() 修改过的信号屏蔽字和 SIGPIPE 处理方式，它们会被 exec 继承。*/
+    posix_spawnattr_t attr;
+    sigset_t empty_mask, default_sigs;
+    sigemptyset(&empty_mask);
+    sigemptyset(&default_sigs);
+    sigaddset(&default_sigs, SIGPIPE);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &empty_mask);
+    posix_spawnattr_setsigdefault(&attr, &default_sigs);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    /* 设置 CGI 程序的运行时环境变量。*/
+    struct cgi_env *env = malloc(sizeof(*env));
+    pid_t pid = FAIL;
+    int rc = ENOMEM;
+    if (NULL != env)
+    {
+        char *argv[] = { (char *)path, NULL };
+        cgi_build_env(env, cli_socket_fd, req, path, query_str);
+        rc = posix_spawn(&pid, path, &actions, &attr, argv, env->vars);
+        free(env);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    /* 子进程不需要 cgi_input 输入端和 cgi_output 输出端，父进程也不需要另外两端。*/
+    close(cgi_input[0]);
+    close(cgi_output[1]);
+    if (0 != rc)
+    {
+        close(cgi_input[1]);
+        close(cgi_output[0]);
+        cgi_slot_release(0);
+        errno = rc;
+        return FAIL;
+    }
+    __atomic_add_fetch(&cgi_limiter.spawned, 1, __ATOMIC_RELAXED);
+
+    *in_fd = cgi_input[1];
+    *out_fd = cgi_output[0];
+
+    return pid;
+}
+
+/* 同步回收子进程，返回 waitpid() 的 status。用于需要退出码的调用者（e.g. 微缓存）。*/
+static int cgi_reap(pid_t pid)
+{
+    int status = 0;
+
+    TRACE_BEGIN(TRACE_CGI_WAIT);
+    while ((-1 == waitpid(pid, &status, 0)) && (errno == EINTR))
+        ;
+    TRACE_END(TRACE_CGI_WAIT);
+    cgi_slot_release(0);
+
+    return status;
+}
+
+/**********************************************************************/
+/* 把子进程交给 main() 的事件循环回收：子进程退出时 pidfd 变为可读，
+ * 处理线程不需要阻塞在 waitpid() 上。内核不支持 pidfd 时退回到同步回收。
+ **********************************************************************/
+static void cgi_reap_async(pid_t pid)
+{
+    struct epoll_event event;
+    int pid_fd = -1;
+
+#ifdef SYS_pidfd_open
+    pid_fd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+
+    if ((pid_fd >= 0) && (pid_fd < MAX_CONNS) && (cgi_epoll_fd >= 0))
+    {
+        fcntl(pid_fd, F_SETFD, FD_CLOEXEC);
+        conn_table[pid_fd].cgi_pid = pid;
+        event.data.fd = pid_fd;
+        event.events = EPOLLIN;
+        if (SUCCESS == epoll_ctl(cgi_epoll_fd, EPOLL_CTL_ADD, pid_fd, &event))
+            return;
+        conn_table[pid_fd].cgi_pid = 0;
+    }
+    if (pid_fd >= 0)
+        close(pid_fd);
+    cgi_reap(pid);
+}
+
+/* main() 事件循环：pidfd 可读，表示 CGI 子进程已经退出。*/
+void cgi_reaped(int pid_fd)
+{
+    pid_t pid = conn_table[pid_fd].cgi_pid;
+    int status;
+
+    conn_table[pid_fd].cgi_pid = 0;
+    close(pid_fd);  // 关闭 fd 会自动从 epoll 实例中删除。
+    waitpid(pid, &status, 0);
+    cgi_slot_release(1);
+}
+
+/* 状态页面：输出 CGI 子进程的并发和排队情况。*/
+void cgi_status(intptr_t cli_socket_fd)
+{
+    char buff[1024];
+
+    pthread_mutex_lock(&cgi_limiter.lock);
+    snprintf(buff, sizeof(buff),
+             "running=%d max_children=%d waiting=%d max_queue=%d spawned=%lu queued=%lu "
+             "rejected=%lu reaped_async=%lu\n",
+             cgi_limiter.running, CGI_MAX_CHILDREN, cgi_limiter.waiting, CGI_MAX_QUEUE,
+             __atomic_load_n(&cgi_limiter.spawned, __ATOMIC_RELAXED), cgi_limiter.queued,
+             cgi_limiter.rejected, cgi_limiter.reaped_async);
+    pthread_mutex_unlock(&cgi_limiter.lock);
+
+    send_all(cli_socket_fd, buff, strlen(buff));
+}
+
+/**********************************************************************/
+/* Execute a CGI script.  Will need to set environment variables as
+ * appropriate.
+ * Parameters: client socket descriptor
+ *             parsed request (headers already consumed)
+ *             path to the CGI script
+ *             query string (GET only) */
+/**********************************************************************/
+void execute_cgi(intptr_t cli_socket_fd, const struct http_request *req,
+                 const char *path, const char *query_str)
+{
+    char buff[1024];
+    const char *method = req->method;
+    long long content_len = req->content_len;
+
+    if (0 == strcasecmp(method, "POST"))
+    {  // POST
+
+        /* Request Body 的长度来自 Content-Length。*/
+#ifdef DEBUG
+        printf("content length: %lld", content_len);
+#endif
+        if (-1 == content_len)
+        {
+            bad_request(cli_socket_fd);  // HTTP Request Body 中没有 Content-Length 字段
+            return;
+        }
+    }
+
+    int cgi_in, cgi_out;
+    TRACE_BEGIN(TRACE_CGI_SPAWN);
+    pid_t pid = cgi_spawn(cli_socket_fd, req, path, query_str, &cgi_in, &cgi_out);
+    TRACE_END(TRACE_CGI_SPAWN);
+    if (FAIL == pid)
+    {
+        if (EAGAIN == errno)
+            service_unavailable(cli_socket_fd);  // 子进程数已达上限且排队已满。
+        else
+            cannot_execute(cli_socket_fd);
+        return;
+    }
+
+    sprintf(buff, "HTTP/1.0 200 OK\r\n");
+    send(cli_socket_fd, buff, strlen(buff), 0);
+
+    /* 将 POST request 通过 Pipe 传递到子进程。*/
+    TRACE_BEGIN(TRACE_CGI_BODY);
+    if (0 == strcasecmp(method, "POST"))
+    {
+        /* 将 Client Request Body 从 Socket 直接 splice() 到子进程的 STDIN Pipe。*/
+        splice_body(cli_socket_fd, cgi_in, content_len);
+    }
+    close(cgi_in);
+    TRACE_END(TRACE_CGI_BODY);
+
+    /* 把子进程的处理结果从 cgi_out 直接 splice() 到 Client。*/
+    TRACE_BEGIN(TRACE_CGI_OUTPUT);
+    splice_output(cgi_out, cli_socket_fd);
+    close(cgi_out);
+    TRACE_END(TRACE_CGI_OUTPUT);
+
+    cgi_reap_async(pid);
+}
+
+/**********************************************************************/
+/* Inform the client that the upstream server failed to respond.
+ * Parameter: the client socket descriptor. */
+/**********************************************************************/
+void bad_gateway(intptr_t cli_socket_fd)
+{
+    char buff[1024];
+
+    sprintf(buff, "HTTP/1.0 502 Bad Gateway\r\n");
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+
+    sprintf(buff, SERVER_STRING);
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+
+    sprintf(buff, "Content-Type: text/html\r\n");
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+
+    sprintf(buff, "\r\n");
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+
+    sprintf(buff, "<P>The upstream server did not return a valid response.\r\n");
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+}
+
+
+
+
+/*************************
+ * RATE LIMITING
+ *************************/
+
+/* 令牌桶表规格参数：每个分片是一个独立的开放寻址表，槽位数为 2 的幂。*/
+#define RATELIMIT_SHARDS    16
+#define RATELIMIT_SLOTS     4096                // 每个分片的槽位数。
+#define RATELIMIT_PROBES    16                  // 线性探测的最大长度，超出时放行（fail open）。
+#define RATELIMIT_IDLE_MS   60000               // 闲置超过该时间的令牌桶可以被其它 Client 复用。
+
+/* 限流规则：prefix 为 NULL 的规则按 Client 对每个 Request（包括每个 HTTP/2 Stream）计数，
+ * 第一个 Request 的令牌在 accept 时预先扣除；其余规则按 URL 前缀对请求计数。
+ * rate 为每秒补充的令牌数（至少为 1），burst 为令牌桶容量。*/
+struct ratelimit_rule
+{
+    const char *prefix;
+    unsigned int rate;
+    unsigned int burst;
+};
+
+static const struct ratelimit_rule ratelimit_rules[] = {
+    { NULL, 50, 100 },
+    { "/check.cgi", 20, 40 },
+    { "/uploads/", 5, 10 },
+};
+
+/* 令牌桶槽位。key 为 0 表示空闲；state 高 32 位为剩余令牌数（千分之一令牌），
+ * 低 32 位为上次更新的时间（毫秒），state 为 0 表示令牌桶是满的。
+ * 两个字段都通过 CAS 更新，检查路径上没有任何锁。*/
+struct ratelimit_slot
+{
+    uint64_t key;
+    uint64_t state;
+} __attribute__((aligned(16)));
+
+static struct ratelimit_slot ratelimit_table[RATELIMIT_SHARDS][RATELIMIT_SLOTS];
+
+/* 运行时指标，原子更新。*/
+static unsigned long ratelimit_allowed;
+static unsigned long ratelimit_limited;
+static unsigned long ratelimit_evictions;
+static unsigned long ratelimit_overflows;
+
+/* 以 Client IP 和规则编号计算令牌桶的 key（FNV-1a），保证不为 0。*/
+static uint64_t ratelimit_key(const struct conn_info *conn, size_t rule_idx)
+{
+    const unsigned char *p;
+    size_t len, i;
+    uint64_t h = 14695981039346656037ULL;
+
+    if (AF_INET6 == conn->addr.sa.sa_family)
+    {
+        p = (const unsigned char *)&conn->addr.in6.sin6_addr;
+        len = sizeof(conn->addr.in6.sin6_addr);
+    }
+    else
+    {
+        p = (const unsigned char *)&conn->addr.in.sin_addr;
+        len = sizeof(conn->addr.in.sin_addr);
+    }
+    for (i = 0; i < len; i++)
+        h = (h ^ p[i]) * 1099511628211ULL;
+    h = (h ^ rule_idx) * 1099511628211ULL;
+
+    return h ? h : 1;
+}
+
+/* 在分片中查找（或占用）key 对应的槽位。表满时返回 NULL。*/
+static struct ratelimit_slot *ratelimit_slot_get(uint64_t key, uint32_t now)
+{
+    struct ratelimit_slot *shard = ratelimit_table[key % RATELIMIT_SHARDS];
+    size_t start = (key / RATELIMIT_SHARDS) & (RATELIMIT_SLOTS - 1);
+    struct ratelimit_slot *stale = NULL;
+    uint64_t stale_key = 0, stale_state = 0;
+    int i;
+
+    for (i = 0; i < RATELIMIT_PROBES; i++)
+    {
+        struct ratelimit_slot *slot = &shard[(start + i) & (RATELIMIT_SLOTS - 1)];
+        uint64_t k = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+
+        if (k == key)
+            return slot;
+        if (0 == k)
+        {
+            /* 空槽位：新 key 的令牌桶从满状态开始（state 为 0）。*/
+            if (__atomic_compare_exchange_n(&slot->key, &k, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+                (k == key))
+                return slot;
+            continue;
+        }
+
+        /* 记录探测路径上第一个闲置的槽位，找不到 key 时复用它。
+         * state 为 0 的槽位刚被占用（或刚被淘汰重置），还没有时间戳，不能视为闲置。*/
+        uint64_t s = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        if ((NULL == stale) && (0 != (uint32_t)s) && ((uint32_t)(now - (uint32_t)s) > RATELIMIT_IDLE_MS))
+        {
+            stale = slot;
+            stale_key = k;
+            stale_state = s;
+        }
+    }
+
+    /* 老化淘汰：先 CAS 把 state 重置为满令牌桶，使其它探测者不再视其为闲置，
+     * 保证同一个闲置槽位只会被一个新 key 抢到；再替换 key。
+     * 与同一槽位上旧 key 的并发更新之间存在短暂竞争，最多让新 Client 多用或少用一个令牌。*/
+    if ((NULL != stale) &&
+        __atomic_compare_exchange_n(&stale->state, &stale_state, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        if (__atomic_compare_exchange_n(&stale->key, &stale_key, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+            (stale_key == key))
+        {
+            __atomic_add_fetch(&ratelimit_evictions, 1, __ATOMIC_RELAXED);
+            return stale;
+        }
+    }
+
+    return NULL;
+}
+
+/**********************************************************************/
+/* 从 Client 在指定规则下的令牌桶中取出一个令牌。
+ * 令牌在取用时按流逝的时间惰性补充，不需要后台线程。
+ * Returns：
+ *   - SUCCESS 表示放行，FAIL 表示超出限制。
+ **********************************************************************/
+static int ratelimit_take(const struct conn_info *conn, size_t rule_idx)
+{
+    const struct ratelimit_rule *rule = &ratelimit_rules[rule_idx];
+    uint32_t now = (uint32_t)(now_us() / 1000);
+    uint64_t full = (uint64_t)rule->burst * 1000;
+    struct ratelimit_slot *slot;
+    uint64_t s, tokens;
+
+    if (0 == conn->addr_len)
+        return SUCCESS;  // 没有 Client 地址（e.g. 内部 socketpair），不限流。
+
+    now = now ? now : 1;  // 时间 0 保留给 "满令牌桶" 状态。
+    slot = ratelimit_slot_get(ratelimit_key(conn, rule_idx), now);
+    if (NULL == slot)
+    {   /* 探测范围内没有可用的槽位，放行而不是误伤正常 Client。*/
+        __atomic_add_fetch(&ratelimit_overflows, 1, __ATOMIC_RELAXED);
+        return SUCCESS;
+    }
+
+    s = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    for ( ;; )
+    {
+        if (0 == s)
+        {
+            tokens = full;
+        }
+        else
+        {
+            /* 每毫秒补充 rate 个千分之一令牌。*/
+            tokens = (s >> 32) + (uint64_t)(uint32_t)(now - (uint32_t)s) * rule->rate;
+            if (tokens > full)
+                tokens = full;
+        }
+
+        if (tokens < 1000)
+        {
+            __atomic_add_fetch(&ratelimit_limited, 1, __ATOMIC_RELAXED);
+            return FAIL;
+        }
+        if (__atomic_compare_exchange_n(&slot->state, &s, ((tokens - 1000) << 32) | now, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            break;
+    }
+
+    __atomic_add_fetch(&ratelimit_allowed, 1, __ATOMIC_RELAXED);
+    return SUCCESS;
+}
+
+/* accept 之后的连接级限流检查。*/
+int ratelimit_check_conn(const struct conn_info *conn)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(ratelimit_rules) / sizeof(ratelimit_rules[0]); i++)
+    {
+        if ((NULL == ratelimit_rules[i].prefix) && (FAIL == ratelimit_take(conn, i)))
+            return FAIL;
+    }
+
+    return SUCCESS;
+}
+
+/* 解析 Request Line 之后的限流检查：Client 级规则（accept 时已扣除的除外）和按 URL 前缀的规则。
+ * HTTP/2 的 Stream 复用同一个连接，只有在这里按 Request 计数才能限制住它们。*/
+int ratelimit_check_request(struct conn_info *conn, const char *url)
+{
+    int charged = conn->ratelimit_charged;
+    size_t i;
+
+    conn->ratelimit_charged = 0;
+    for (i = 0; i < sizeof(ratelimit_rules) / sizeof(ratelimit_rules[0]); i++)
+    {
+        const char *prefix = ratelimit_rules[i].prefix;
+        if (NULL == prefix)
+        {
+            if (!charged && (FAIL == ratelimit_take(conn, i)))
+                return FAIL;
+        }
+        else if ((0 == strncmp(url, prefix, strlen(prefix))) && (FAIL == ratelimit_take(conn, i)))
+        {
+            return FAIL;
+        }
+    }
+
+    return SUCCESS;
+}
+
+/* 启动时生成的 429 Response，限流时只需要一次 send()。
+ * rate 至少为 1，所以 1 秒之内一定会补充出新的令牌。*/
+static char ratelimit_response[512];
+static size_t ratelimit_response_len;
+
+void ratelimit_init(void)
+{
+    const char *body = "<HTML><TITLE>Too Many Requests</TITLE>\r\n"
+                       "<BODY><P>Too many requests, please retry later.\r\n</BODY></HTML>\r\n";
+
+    ratelimit_response_len = snprintf(ratelimit_response, sizeof(ratelimit_response),
+                                      "HTTP/1.0 429 Too Many Requests\r\n"
+                                      SERVER_STRING
+                                      "Content-Type: text/html\r\n"
+                                      "Retry-After: 1\r\n"
+                                      "Content-Length: %zu\r\n"
+                                      "\r\n"
+                                      "%s", strlen(body), body);
+}
+
+/**********************************************************************/
+/* Inform the client that it has exceeded its request rate.
+ * Parameter: the client socket descriptor.
+ * 非阻塞发送：Socket Buffer 放不下时直接丢弃，不让被限流的 Client 占用处理时间。*/
+/**********************************************************************/
+void too_many_requests(intptr_t cli_socket_fd)
+{
+    send(cli_socket_fd, ratelimit_response, ratelimit_response_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+/* 以 text/plain 格式输出限流规则、令牌桶占用情况和计数。*/
+void ratelimit_status(intptr_t cli_socket_fd)
+{
+    char buff[1024];
+    size_t i, j, used = 0;
+
+    for (i = 0; i < RATELIMIT_SHARDS; i++)
+    {
+        for (j = 0; j < RATELIMIT_SLOTS; j++)
+            used += (0 != __atomic_load_n(&ratelimit_table[i][j].key, __ATOMIC_RELAXED));
+    }
+    snprintf(buff, sizeof(buff), "buckets=%zu capacity=%d allowed=%lu limited=%lu evictions=%lu overflows=%lu\n",
+             used, RATELIMIT_SHARDS * RATELIMIT_SLOTS,
+             __atomic_load_n(&ratelimit_allowed, __ATOMIC_RELAXED),
+             __atomic_load_n(&ratelimit_limited, __ATOMIC_RELAXED),
+             __atomic_load_n(&ratelimit_evictions, __ATOMIC_RELAXED),
+             __atomic_load_n(&ratelimit_overflows, __ATOMIC_RELAXED));
+    send_all(cli_socket_fd, buff, strlen(buff));
+
+    for (i = 0; i < sizeof(ratelimit_rules) / sizeof(ratelimit_rules[0]); i++)
+    {
+        snprintf(buff, sizeof(buff), "rule %s rate=%u/s burst=%u\n",
+                 ratelimit_rules[i].prefix ? ratelimit_rules[i].prefix : "<connection>",
+                 ratelimit_rules[i].rate, ratelimit_rules[i].burst);
+        send_all(cli_socket_fd, buff, strlen(buff));
+    }
+}
+
+
+
+/*************************
+ * UPLOAD
+ *************************/
+
+/* 上传规格参数。*/
+#define UPLOAD_URL_PREFIX  "/uploads/"
+#define UPLOAD_DIR         "htdocs/uploads"
+#define UPLOAD_MAX_BYTES   (16LL * 1024 * 1024 * 1024)  // 单个文件的大小上限。
+#define UPLOAD_FSYNC       0                            // 为 1 时在 rename 之前 fsync()，保证掉电后文件完整。
+#define UPLOAD_LINGER_MS   2000                         // 拒绝上传后继续读取并丢弃 Body 的最长时间。
+
+/**********************************************************************/
+/* Inform the client that the request is not allowed on this resource.
+ * Parameter: the client socket descriptor. */
+/**********************************************************************/
+void forbidden(intptr_t cli_socket_fd)
+{
+    char buff[1024];
+
+    sprintf(buff, "HTTP/1.0 403 Forbidden\r\n");
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+
+    sprintf(buff, SERVER_STRING);
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+
+    sprintf(buff, "Content-Type: text/html\r\n");
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+
+    sprintf(buff, "\r\n");
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+
+    sprintf(buff, "<P>Uploads are only accepted under %s with a plain file name.\r\n", UPLOAD_URL_PREFIX);
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+}
+
+/**********************************************************************/
+/* Inform the client that the request body exceeds the upload limit.
+ * Parameter: the client socket descriptor. */
+/**********************************************************************/
+void payload_too_large(intptr_t cli_socket_fd)
+{
+    char buff[1024];
+
+    sprintf(buff, "HTTP/1.0 413 Payload Too Large\r\n");
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+
+    sprintf(buff, SERVER_STRING);
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+
+    sprintf(buff, "Content-Type: text/html\r\n");
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+
+    sprintf(buff, "\r\n");
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+
+    sprintf(buff, "<P>The upload exceeds the limit of %lld bytes.\r\n", UPLOAD_MAX_BYTES);
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+}
+
+/* 拒绝上传时 Client 可能还在发送 Body：关闭写端后读取并丢弃一段时间，
+ * 避免带着未读数据 close() 触发 RST，导致 Client 收不到 413。*/
+static void upload_linger(int sock_fd)
+{
+    char buff[8192];
+    long long deadline_ns = now_ns() + UPLOAD_LINGER_MS * 1000000LL;
+
+    shutdown(sock_fd, SHUT_WR);
+    while ((now_ns() < deadline_ns) && (recv_wait(sock_fd, buff, sizeof(buff), 0, UPLOAD_LINGER_MS) > 0))
+        ;
+}
+
+/* 判断 url 是否指向上传目录。*/
+int is_upload_url(const char *url)
+{
+    return 0 == strncmp(url, UPLOAD_URL_PREFIX, strlen(UPLOAD_URL_PREFIX));
+}
+
+/* 上传文件名只允许字母、数字和 . _ -，且不能以 . 开头，避免路径穿越和覆盖临时文件。*/
+static int upload_name_valid(const char *name)
+{
+    const char *c;
+
+    if (('\0' == *name) || ('.' == *name) || (strlen(name) > 200))
+        return 0;
+    for (c = name; *c; c++)
+    {
+        if (!isalnum((unsigned char)*c) && ('.' != *c) && ('_' != *c) && ('-' != *c))
+            return 0;
+    }
+
+    return 1;
+}
+
+/**********************************************************************/
+/* 接收 Transfer-Encoding: chunked 的上传 Body（e.g. curl -T -）：chunk-size 行由 get_line()
+ * 逐字节解析，不会多读 chunk-data，chunk-data 仍然通过 splice_body() 零拷贝写入文件。
+ * Returns：
+ *   - SUCCESS；累计大小超过 UPLOAD_MAX_BYTES 时立即停止接收，返回 FAIL 并把 errno 置为 EFBIG。
+ **********************************************************************/
+static int upload_chunked(int sock_fd, int fd)
+{
+    char line[1024];
+    char *end;
+    long long total = 0;
+
+    for ( ;; )
+    {
+        /* chunk-size [; chunk-ext] CRLF */
+        if (get_line(sock_fd, line, sizeof(line)) <= 0)
+            return FAIL;
+        errno = 0;
+        long long size = strtoll(line, &end, 16);
+        if ((end == line) || (size < 0) || (0 != errno))
+            return FAIL;
+        if (0 == size)
+            break;
+        if (size > UPLOAD_MAX_BYTES - total)
+        {
+            errno = EFBIG;
+            return FAIL;
+        }
+        total += size;
+
+        /* chunk-data CRLF */
+        if ((FAIL == splice_body(sock_fd, fd, size)) ||
+            (get_line(sock_fd, line, sizeof(line)) <= 0) || strcmp(line, "\n"))
+            return FAIL;
+    }
+
+    /* trailer-part CRLF：Trailer 不影响文件内容，直接丢弃。*/
+    do
+    {
+        if (get_line(sock_fd, line, sizeof(line)) <= 0)
+            return FAIL;
+    } while (strcmp(line, "\n"));
+
+    return SUCCESS;
+}
+
+/**********************************************************************/
+/* 处理 PUT（以及 POST 到上传目录）请求，把 Request Body 写入 UPLOAD_DIR。
+ *   1. 先写入同目录下的临时文件，已知长度时用 fallocate() 预分配空间；
+ *   2. Body 通过 splice() socket -> pipe -> file 写入，不经过用户态缓冲区；
+ *      chunked Body 逐个 chunk 写入，边接收边检查 UPLOAD_MAX_BYTES；
+ *   3. 接收完整后 rename() 到目标文件名，读者不会看到写了一半的文件。
+ * Parameters：
+ *   - client socket fd、已解析 Headers 的 request、URL（不含 query string）。
+ **********************************************************************/
+void upload_handle(intptr_t cli_socket_fd, const struct http_request *req, const char *url)
+{
+    char buff[1024];
+    char path[512];
+    char tmp_path[512];
+    const char *name = url + strlen(UPLOAD_URL_PREFIX);
+    long long len = req->chunked ? -1 : req->content_len;  // 同时存在时以 chunked 为准。
+    struct stat st;
+
+    if (!is_upload_url(url) || !upload_name_valid(name))
+    {
+        forbidden(cli_socket_fd);
+        return;
+    }
+    if (len > UPLOAD_MAX_BYTES)
+    {
+        payload_too_large(cli_socket_fd);
+        upload_linger(cli_socket_fd);
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", UPLOAD_DIR, name);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/.%s.XXXXXX", UPLOAD_DIR, name);
+    int existed = (0 == stat(path, &st));
+
+    int fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (FAIL == fd)
+    {
+        cannot_execute(cli_socket_fd);
+        return;
+    }
+    fchmod(fd, 0644);
+
+    /* 预分配空间：减少碎片，并且在接收 Body 之前就能发现磁盘空间不足。*/
+    if ((len > 0) && (FAIL == fallocate(fd, 0, 0, len)) && (errno != EOPNOTSUPP))
+    {
+        close(fd);
+        unlink(tmp_path);
+        payload_too_large(cli_socket_fd);
+        return;
+    }
+
+    /* Client 发送了 Expect: 100-continue 时，校验通过后才让它发送 Body。*/
+    const char *expect = get_header(req, "Expect");
+    if ((NULL != expect) && (0 == strcasecmp(expect, "100-continue")))
+    {
+        sprintf(buff, "HTTP/1.1 100 Continue\r\n\r\n");
+        send_all(cli_socket_fd, buff, strlen(buff));
+    }
+
+    /* 既没有 Content-Length 也不是 chunked 时 Body 为空（RFC 7230 3.3.3），splice_body() 直接返回。*/
+    TRACE_BEGIN(TRACE_UPLOAD);
+    int rc = req->chunked ? upload_chunked(cli_socket_fd, fd) : splice_body(cli_socket_fd, fd, len);
+    int too_large = (SUCCESS != rc) && (EFBIG == errno);
+#if UPLOAD_FSYNC
+    if (SUCCESS == rc)
+        rc = fsync(fd);
+#endif
+    if (FAIL == close(fd))
+        rc = FAIL;
+    if ((SUCCESS == rc) && (FAIL == rename(tmp_path, path)))
+        rc = FAIL;
+    TRACE_END(TRACE_UPLOAD);
+
+    if (SUCCESS != rc)
+    {
+        unlink(tmp_path);
+        if (too_large)
+        {
+            payload_too_large(cli_socket_fd);
+            upload_linger(cli_socket_fd);
+        }
+        else
+            bad_request(cli_socket_fd);
+        return;
+    }
+
+    /* 新建文件返回 201 Created，覆盖已有文件返回 200 OK。*/
+    sprintf(buff, "HTTP/1.0 %s\r\n", existed ? "200 OK" : "201 Created");
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+
+    sprintf(buff, SERVER_STRING);
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+
+    sprintf(buff, "Location: %s\r\n", url);
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+
+    sprintf(buff, "Content-Type: text/plain\r\n");
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+
+    sprintf(buff, "\r\n");
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+
+    sprintf(buff, "Stored %lld bytes at %s\r\n", len, url);
+    send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+}
+
+
+
+/*************************
+ * REVERSE PROXY
+ *************************/
+
+/* 反向代理规格参数。*/
+#define PROXY_POOL_SIZE          8     // 每个 upstream 保留的空闲 keep-alive 连接上限。
+#define PROXY_CONNECT_TIMEOUT_MS 1000  // 连接 upstream 的超时时间。
+#define PROXY_HEALTH_INTERVAL    2     // 健康检查周期（秒）。
+#define PROXY_HEALTH_TIMEOUT_MS  1000  // 健康检查等待响应的超时时间。
+
+/* 负载均衡策略。*/
+#define BALANCE_ROUND_ROBIN  0
+#define BALANCE_LEAST_CONN   1
+
+struct upstream
+{
+    const char *addr;       // "127.0.0.1:9001" 或 "unix:/path/to/app.sock"
+
+    /* 运行时状态，由所属 route 的 lock 保护。*/
+    struct sockaddr_storage sa;
+    socklen_t sa_len;
+    int healthy;
+    int active;                        // 正在处理请求的连接数，用于 least-connections。
+    int num_idle;
+    int idle_fds[PROXY_POOL_SIZE];     // 空闲的 keep-alive 连接池。
+
+    /* 指标。*/
+    unsigned long requests;
+    unsigned long failures;
+    long long latency_total_us;
+    long long latency_max_us;
+};
+
+struct proxy_route
+{
+    const char *prefix;         // URL 前缀，e.g. "/app/"
+    int strip_prefix;           // 转发前是否去掉 URL 前缀。
+    int policy;                 // BALANCE_ROUND_ROBIN 或 BALANCE_LEAST_CONN
+    const char *health_uri;     // 健康检查 URI；NULL 表示只检查能否建立连接。
+    struct upstream *upstreams;
+    int num_upstreams;
+
+    pthread_mutex_t lock;
+    unsigned int rr_next;
+};
+
+/* 反向代理路由配置：按顺序匹配 URL 前缀。
+ * 默认不启用任何路由（也不会启动健康检查线程），以 -DENABLE_PROXY 编译（make httpd-proxy）时
+ * 启用下面的示例路由，按实际部署修改 upstream 地址。*/
+#ifdef ENABLE_PROXY
+static struct upstream app_upstreams[] = {
+    { .addr = "127.0.0.1:9001" },
+    { .addr = "unix:/tmp/tinyhttpd-app.sock" },
+};
+
+static struct proxy_route proxy_routes[] = {
+    {
+        .prefix = "/app/",
+        .strip_prefix = 0,
+        .policy = BALANCE_ROUND_ROBIN,
+        .health_uri = "/health",
+        .upstreams = app_upstreams,
+        .num_upstreams = sizeof(app_upstreams) / sizeof(app_upstreams[0]),
+    },
+    { .prefix = NULL },  // 结束标记
+};
+#else
+static struct proxy_route proxy_routes[] = {
+    { .prefix = NULL },  // 结束标记
+};
+#endif
+
+/**********************************************************************/
+/* 解析 upstream 地址，支持 "host:port" 和 "unix:/path" 两种格式。
+ **********************************************************************/
+static int upstream_resolve(struct upstream *up)
+{
+    if (0 == strncmp(up->addr, "unix:", 5))
+    {
+        struct sockaddr_un *sun = (struct sockaddr_un *)&up->sa;
+        memset(sun, 0, sizeof(*sun));
+        sun->sun_family = AF_UNIX;
+        snprintf(sun->sun_path, sizeof(sun->sun_path), "%s", up->addr + 5);
+        up->sa_len = sizeof(*sun);
+        return SUCCESS;
+    }
+
+    char host[256];
+    const char *colon = strrchr(up->addr, ':');
+    if ((NULL == colon) || ((size_t)(colon - up->addr) >= sizeof(host)))
+        return FAIL;
+    memcpy(host, up->addr, colon - up->addr);
+    host[colon - up->addr] = '\0';
+
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (SUCCESS != getaddrinfo(host, colon + 1, &hints, &res))
+        return FAIL;
+
+    memcpy(&up->sa, res->ai_addr, res->ai_addrlen);
+    up->sa_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return SUCCESS;
+}
+
+/**********************************************************************/
+/* 建立一条到 upstream 的非阻塞连接，带连接超时。
+ * Returns：
+ *   - 连接 fd，失败返回 FAIL。
+ **********************************************************************/
+static int upstream_connect(struct upstream *up)
+{
+    int fd;
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+
+    if (0 == up->sa_len)
+        return FAIL;
+
+    if (FAIL == (fd = socket(up->sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)))
+        return FAIL;
+
+    if (FAIL == connect(fd, (struct sockaddr *)&up->sa, up->sa_len))
+    {
+        if ((errno != EINPROGRESS) && (errno != EAGAIN))
+        {
+            close(fd);
+            return FAIL;
+        }
+        if ((wait_fd(fd, POLLOUT, PROXY_CONNECT_TIMEOUT_MS) <= 0) ||
+            (FAIL == getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len)) || (0 != err))
+        {
+            close(fd);
+            return FAIL;
+        }
+    }
+
+    if (AF_UNIX != up->sa.ss_family)
+    {
+        int optval = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    }
+
+    return fd;
+}
+
+/* 检查连接池中的空闲连接是否仍然可用：对端没有关闭，也没有多余的数据。*/
+static int upstream_conn_alive(int fd)
+{
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return (n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+}
+
+/* 按照 route 的负载均衡策略选择一个健康的 upstream，调用者需持有 route->lock。*/
+static struct upstream *proxy_pick_upstream(struct proxy_route *route)
+{
+    struct upstream *best = NULL;
+    int i;
+
+    for (i = 0; i < route->num_upstreams; i++)
+    {
+        struct upstream *up;
+
+        if (BALANCE_ROUND_ROBIN == route->policy)
+        {
+            up = &route->upstreams[route->rr_next++ % route->num_upstreams];
+            if (up->healthy)
+                return up;
+        }
+        else
+        {
+            up = &route->upstreams[i];
+            if (up->healthy && ((NULL == best) || (up->active < best->active)))
+                best = up;
+        }
+    }
+
+    return best;
+}
+
+/**********************************************************************/
+/* 从连接池中获取（或新建）一条 upstream 连接。
+ * 连接失败的 upstream 会被标记为不健康，由健康检查负责恢复。
+ * Returns：
+ *   - 连接 fd，并通过 out_up 返回所选的 upstream；失败返回 FAIL。
+ **********************************************************************/
+static int proxy_acquire(struct proxy_route *route, struct upstream **out_up)
+{
+    int attempt;
+
+    for (attempt = 0; attempt < route->num_upstreams; attempt++)
+    {
+        int fd = FAIL;
+
+        pthread_mutex_lock(&route->lock);
+        struct upstream *up = proxy_pick_upstream(route);
+        if (NULL == up)
+        {
+            pthread_mutex_unlock(&route->lock);
+            return FAIL;
+        }
+        up->active++;
+        while ((FAIL == fd) && (up->num_idle > 0))
+        {
+            fd = up->idle_fds[--up->num_idle];
+            if (!upstream_conn_alive(fd))
+            {
+                close(fd);
+                fd = FAIL;
+            }
+        }
+        pthread_mutex_unlock(&route->lock);
+
+        if (FAIL == fd)
+            fd = upstream_connect(up);
+        if (FAIL != fd)
+        {
+            *out_up = up;
+            return fd;
+        }
+
+        pthread_mutex_lock(&route->lock);
+        up->active--;
+        up->failures++;
+        if (up->healthy)
+            printf("upstream %s is down (connect failed)\n", up->addr);
+        up->healthy = 0;
+        pthread_mutex_unlock(&route->lock);
+    }
+
+    return FAIL;
+}
+
+/* 归还 upstream 连接：可复用的连接放回连接池，否则关闭；同时记录指标。*/
+static void proxy_release(struct proxy_route *route, struct upstream *up, int fd,
+                          int reusable, int failed, long long latency_us)
+{
+    pthread_mutex_lock(&route->lock);
+    up->active--;
+    up->requests++;
+    if (failed)
+    {
+        up->failures++;
+    }
+    else
+    {
+        up->latency_total_us += latency_us;
+        if (latency_us > up->latency_max_us)
+            up->latency_max_us = latency_us;
+    }
+    if (reusable && (up->num_idle < PROXY_POOL_SIZE))
+    {
+        up->idle_fds[up->num_idle++] = fd;
+        fd = FAIL;
+    }
+    pthread_mutex_unlock(&route->lock);
+
+    if (FAIL != fd)
+        close(fd);
+}
+
+/* 判断是否为 hop-by-hop Header，这些 Header 不能透传给下一跳。*/
+static int is_hop_by_hop(const char *name)
+{
+    return (0 == strcasecmp(name, "Connection")) ||
+           (0 == strcasecmp(name, "Keep-Alive")) ||
+           (0 == strcasecmp(name, "Proxy-Connection")) ||
+           (0 == strcasecmp(name, "TE")) ||
+           (0 == strcasecmp(name, "Upgrade"));
+}
+
+/* 按 URL 前缀匹配反向代理路由，没有匹配时返回 NULL。*/
+struct proxy_route *proxy_match(const char *url)
+{
+    size_t i;
+
+    for (i = 0; NULL != proxy_routes[i].prefix; i++)
+    {
+        if (0 == strncmp(url, proxy_routes[i].prefix, strlen(proxy_routes[i].prefix)))
+            return &proxy_routes[i];
+    }
+
+    return NULL;
+}
+
+/**********************************************************************/
+/* 将 Client Request 转发给 upstream，并把 Response 流式转发回 Client。
+ * 与 upstream 之间使用 HTTP/1.1 keep-alive，Body 双向都只经过固定大小的缓冲区。
+ * Parameters：
+ *   - client socket fd；
+ *   - 已解析 Headers 的 request，Body 仍在 Socket Buffer 中；
+ *   - 匹配到的 proxy route。
+ **********************************************************************/
+void proxy_request(intptr_t cli_socket_fd, const struct http_request *req, struct proxy_route *route)
+{
+    char head[8192];
+    size_t len = 0;
+    int i;
+
+    /* 选择 upstream 并获取连接。*/
+    struct upstream *up = NULL;
+    TRACE_BEGIN(TRACE_PROXY_CONNECT);
+    int up_fd = proxy_acquire(route, &up);
+    TRACE_END(TRACE_PROXY_CONNECT);
+    if (FAIL == up_fd)
+    {
+        service_unavailable(cli_socket_fd);
+        return;
+    }
+
+    /* 构造发往 upstream 的 Request Headers。*/
+    const char *target = req->url;
+    if (route->strip_prefix)
+    {
+        target += strlen(route->prefix) - 1;  // 保留前缀结尾的 '/'。
+        if ('/' != *target)
+            target = "/";
+    }
+    len += snprintf(head + len, sizeof(head) - len, "%s %s HTTP/1.1\r\n", req->method, target);
+
+    char client_ip[NI_MAXHOST];
+    conn_client_addr(cli_socket_fd, client_ip, sizeof(client_ip));
+    const char *forwarded_for = get_header(req, "X-Forwarded-For");
+    int https = (cli_socket_fd < MAX_CONNS) && conn_table[cli_socket_fd].https;
+
+    for (i = 0; (i < req->num_headers) && (len < sizeof(head)); i++)
+    {
+        const struct http_header *hdr = &req->headers[i];
+        /* Expect 由本端处理（见下文），upstream 的 100 Continue 不会转发给 Client。*/
+        if (is_hop_by_hop(hdr->name) || (0 == strcasecmp(hdr->name, "X-Forwarded-For")) ||
+            (0 == strcasecmp(hdr->name, "Expect")))
+            continue;
+        len += snprintf(head + len, sizeof(head) - len, "%s: %s\r\n", hdr->name, hdr->value);
+    }
+    /* Client 没有发送 Host（HTTP/1.0）时使用选中的 upstream 地址，Unix Socket 没有主机名，使用 localhost。*/
+    if ((len < sizeof(head)) && (NULL == get_header(req, "Host")))
+        len += snprintf(head + len, sizeof(head) - len, "Host: %s\r\n",
+                        strncmp(up->addr, "unix:", 5) ? up->addr : "localhost");
+    if (len < sizeof(head))
+        len += snprintf(head + len, sizeof(head) - len,
+                        "X-Forwarded-For: %s%s%s\r\nX-Forwarded-Proto: %s\r\nConnection: keep-alive\r\n\r\n",
+                        forwarded_for ? forwarded_for : "", forwarded_for ? ", " : "", client_ip,
+                        https ? "https" : "http");
+    if (len >= sizeof(head))
+    {
+        proxy_release(route, up, up_fd, 1, 0, 0);  // 连接还没有使用，放回连接池。
+        bad_request(cli_socket_fd);
+        return;
+    }
+    long long start_us = now_us();
+
+    /* Client 发送了 Expect: 100-continue 时，upstream 连接已经就绪，由本端让它发送 Body。*/
+    const char *expect = get_header(req, "Expect");
+    if ((NULL != expect) && (0 == strcasecmp(expect, "100-continue")))
+        send_all(cli_socket_fd, "HTTP/1.1 100 Continue\r\n\r\n", sizeof("HTTP/1.1 100 Continue\r\n\r\n") - 1);
+
+    /* 转发 Request Headers 和 Body：client -> upstream。*/
+    struct conn_reader cli_reader;
+    reader_init(&cli_reader, cli_socket_fd, IO_TIMEOUT_MS);
+    if ((FAIL == send_all(up_fd, head, len)) ||
+        (FAIL == relay_body(&cli_reader, up_fd, req->chunked ? -1 : (req->content_len >= 0 ? req->content_len : 0), req->chunked)))
+    {
+        proxy_release(route, up, up_fd, 0, 1, 0);
+        bad_gateway(cli_socket_fd);
+        return;
+    }
+
+    /* 读取 upstream 的 Status line：HTTP/1.1 200 OK
+     * 1xx 临时响应（100 Continue、103 Early Hints 等）连同它的 Headers 一起丢弃，继续读取最终响应。*/
+    struct conn_reader up_reader;
+    char line[4096];
+    int status;
+    reader_init(&up_reader, up_fd, IO_TIMEOUT_MS);
+    for ( ;; )
+    {
+        if ((reader_getline(&up_reader, line, sizeof(line)) <= 0) || strncmp(line, "HTTP/1.", 7))
+        {
+            proxy_release(route, up, up_fd, 0, 1, 0);
+            bad_gateway(cli_socket_fd);
+            return;
+        }
+        status = atoi(line + 9);
+        if ((status >= 200) || (101 == status))
+            break;
+
+        int n;
+        while (((n = reader_getline(&up_reader, line, sizeof(line))) > 0) &&
+               strcmp(line, "\r\n") && strcmp(line, "\n"))
+            ;
+        if (n <= 0)
+        {
+            proxy_release(route, up, up_fd, 0, 1, 0);
+            bad_gateway(cli_socket_fd);
+            return;
+        }
+    }
+    int keep_alive = ('1' == line[7]);  // HTTP/1.1 默认 keep-alive，HTTP/1.0 默认关闭。
+    long long resp_len = -1;
+    int resp_chunked = 0;
+
+    /* 读取并转发 Response Headers，去掉 hop-by-hop Headers。*/
+    len = snprintf(head, sizeof(head), "%s", line);
+    for ( ;; )
+    {
+        if (reader_getline(&up_reader, line, sizeof(line)) <= 0)
+        {
+            proxy_release(route, up, up_fd, 0, 1, 0);
+            bad_gateway(cli_socket_fd);
+            return;
+        }
+        if ((0 == strcmp(line, "\r\n")) || (0 == strcmp(line, "\n")))
+            break;
+
+        char *colon = strchr(line, ':');
+        if (NULL == colon)
+            continue;
+        *colon = '\0';
+        const char *value = colon + 1;
+        while (IS_SPACE(*value))
+            value++;
+
+        if (0 == strcasecmp(line, "Content-Length"))
+            resp_len = atoll(value);
+        else if ((0 == strcasecmp(line, "Transfer-Encoding")) && strcasestr(value, "chunked"))
+            resp_chunked = 1;
+        else if (0 == strcasecmp(line, "Connection"))
+            keep_alive = (NULL != strcasestr(value, "keep-alive")) ||
+                         (keep_alive && (NULL == strcasestr(value, "close")));
+
+        *colon = ':';
+        if (is_hop_by_hop(line))
+            continue;
+        if (len + strlen(line) < sizeof(head))
+            len += snprintf(head + len, sizeof(head) - len, "%s", line);
+    }
+    if (len + sizeof("Connection: close\r\n\r\n") > sizeof(head))
+    {
+        proxy_release(route, up, up_fd, 0, 1, 0);
+        bad_gateway(cli_socket_fd);
+        return;
+    }
+    len += snprintf(head + len, sizeof(head) - len, "Connection: close\r\n\r\n");
+
+    /* HEAD、1xx、204、304 响应没有 Body。*/
+    if ((0 == strcasecmp(req->method, "HEAD")) || (status < 200) || (204 == status) || (304 == status))
+    {
+        resp_len = 0;
+        resp_chunked = 0;
+    }
+    /* 没有长度信息的 Body 以连接关闭作为结束，这样的连接不能复用。*/
+    if (!resp_chunked && (resp_len < 0))
+        keep_alive = 0;
+
+    /* 转发 Response Headers 和 Body：upstream -> client。*/
+    int failed = 0;
+    int client_ok = (SUCCESS == send_all(cli_socket_fd, head, len));
+    if (client_ok)
+    {
+        if (FAIL == relay_body(&up_reader, cli_socket_fd, resp_len, resp_chunked))
+            failed = 1;
+    }
+
+    /* upstream 多发了数据或者 Client 中途断开时，连接状态不确定，不能放回连接池。*/
+    int reusable = keep_alive && client_ok && !failed && (up_reader.start == up_reader.end);
+    proxy_release(route, up, up_fd, reusable, failed, now_us() - start_us);
+}
+
+/**********************************************************************/
+/* 探测 upstream 是否健康：能够建立连接；配置了 health_uri 时，
+ * 还需要返回 2xx/3xx 的 Status code。
+ **********************************************************************/
+static int proxy_probe(struct proxy_route *route, struct upstream *up)
+{
+    char buff[1024];
+    int fd = upstream_connect(up);
+    int ok;
+
+    if (FAIL == fd)
+        return 0;
+    if (NULL == route->health_uri)
+    {
+        close(fd);
+        return 1;
+    }
+
+    snprintf(buff, sizeof(buff), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+             route->health_uri, up->addr);
+    struct conn_reader reader;
+    reader_init(&reader, fd, PROXY_HEALTH_TIMEOUT_MS);
+    ok = (SUCCESS == send_all(fd, buff, strlen(buff))) &&
+         (reader_getline(&reader, buff, sizeof(buff)) > 9) &&
+         (0 == strncmp(buff, "HTTP/1.", 7)) &&
+         (atoi(buff + 9) >= 200) && (atoi(buff + 9) < 400);
+    close(fd);
+
+    return ok;
+}
+
+/* 健康检查线程：周期性探测所有 upstream，并更新其健康状态。*/
+static void *proxy_health_check(void *arg)
+{
+    size_t i;
+    int j;
+    (void)arg;
+
+    for ( ;; )
+    {
+        for (i = 0; NULL != proxy_routes[i].prefix; i++)
+        {
+            struct proxy_route *route = &proxy_routes[i];
+            for (j = 0; j < route->num_upstreams; j++)
+            {
+                struct upstream *up = &route->upstreams[j];
+                int ok = proxy_probe(route, up);
+
+                pthread_mutex_lock(&route->lock);
+                if (ok != up->healthy)
+                    printf("upstream %s is %s\n", up->addr, ok ? "up" : "down");
+                up->healthy = ok;
+                while (!ok && (up->num_idle > 0))  // 不健康的 upstream 不再保留空闲连接。
+                    close(up->idle_fds[--up->num_idle]);
+                pthread_mutex_unlock(&route->lock);
+            }
+        }
+        sleep(PROXY_HEALTH_INTERVAL);
+    }
+
+    return NULL;
+}
+
+/* 初始化反向代理：解析 upstream 地址，并启动健康检查线程。*/
+void proxy_init(void)
+{
+    pthread_t health_thread;
+    size_t i;
+    int j;
+
+    for (i = 0; NULL != proxy_routes[i].prefix; i++)
+    {
+        struct proxy_route *route = &proxy_routes[i];
+        pthread_mutex_init(&route->lock, NULL);
+        for (j = 0; j < route->num_upstreams; j++)
+        {
+            struct upstream *up = &route->upstreams[j];
+            if (FAIL == upstream_resolve(up))
+                fprintf(stderr, "Resolve upstream %s failed\n", up->addr);
+            up->healthy = 0;  // 由第一次健康检查决定。
+            printf("proxy %s -> %s\n", route->prefix, up->addr);
+        }
+    }
+
+    if (NULL == proxy_routes[0].prefix)
+        return;
+    if (pthread_create(&health_thread, NULL, proxy_health_check, NULL) != 0)
+        error_msg("pthread create failed");
+    pthread_detach(health_thread);
+}
+
+/* 状态页面：输出每个 upstream 的健康状态、连接数和延迟指标。*/
+void proxy_status(intptr_t cli_socket_fd)
+{
+    char buff[1024];
+    size_t i;
+    int j;
+
+    for (i = 0; NULL != proxy_routes[i].prefix; i++)
+    {
+        struct proxy_route *route = &proxy_routes[i];
+        pthread_mutex_lock(&route->lock);
+        for (j = 0; j < route->num_upstreams; j++)
+        {
+            struct upstream *up = &route->upstreams[j];
+            unsigned long ok = up->requests - up->failures;
+            snprintf(buff, sizeof(buff),
+                     "route=%s upstream=%s policy=%s healthy=%d active=%d idle=%d "
+                     "requests=%lu failures=%lu latency_avg_us=%lld latency_max_us=%lld\n",
+                     route->prefix, up->addr,
+                     (BALANCE_ROUND_ROBIN == route->policy) ? "round_robin" : "least_conn",
+                     up->healthy, up->active, up->num_idle, up->requests, up->failures,
+                     ok ? up->latency_total_us / (long long)ok : 0, up->latency_max_us);
+            send_all(cli_socket_fd, buff, strlen(buff));
+        }
+        pthread_mutex_unlock(&route->lock);
+    }
+}
+
+
+
+/*************************
+ * MICRO CACHE
+ *************************/
+
+/* 动态响应微缓存规格参数。*/
+#define MICROCACHE_BUCKETS          1024
+#define MICROCACHE_MAX_BYTES        (8 * 1024 * 1024)  // 全部缓存条目的内存预算。
+#define MICROCACHE_MAX_ENTRY_BYTES  (256 * 1024)       // 单个响应的缓存上限，超过则不缓存。
+#define MICROCACHE_WAIT_MS          5000               // 合并请求等待 in-flight CGI 的最长时间。
+#define MICROCACHE_MAX_VARY         4
+
+/* 微缓存规则：只有匹配规则（opt-in）的 GET CGI 请求才会被缓存。*/
+struct microcache_rule
+{
+    const char *path;                         // CGI 路径，e.g. "/check.cgi"
+    int ttl_ms;                               // 新鲜期。
+    int stale_ms;                             // 过期后仍可返回旧响应、并在后台刷新的时长。
+    const char *vary[MICROCACHE_MAX_VARY];    // 参与缓存 key 的 Request Headers。
+};
+
+static const struct microcache_rule microcache_rules[] = {
+    { .path = "/check.cgi", .ttl_ms = 1000, .stale_ms = 5000, .vary = { "Accept-Language" } },
+};
+
+#define NUM_MICROCACHE_RULES (sizeof(microcache_rules) / sizeof(microcache_rules[0]))
+
+/* 缓存的 CGI 输出（CGI Headers + Body），不可变，以引用计数管理生命周期。*/
+struct cache_blob
+{
+    int refs;
+    size_t len;
+    char data[];
+};
+
+struct cache_entry
+{
+    struct cache_entry *hnext;        // 哈希桶链表。
+    struct cache_entry *lru_prev;     // LRU 链表，头部为最近使用。
+    struct cache_entry *lru_next;
+    char *key;
+    unsigned int hash;
+    struct cache_blob *blob;          // NULL 表示还没有可用的响应。
+    long long expires_us;
+    long long stale_until_us;
+    int filling;                      // 有线程正在执行 CGI 填充此条目，其他请求等待它完成。
+};
+
+struct microcache
+{
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    struct cache_entry *buckets[MICROCACHE_BUCKETS];
+    struct cache_entry *lru_head;
+    struct cache_entry *lru_tail;
+    size_t bytes;
+    unsigned long entries;
+
+    /* 指标。*/
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stale;
+    unsigned long coalesced;
+    unsigned long bypass;
+    unsigned long evictions;
+};
+
+static struct microcache microcache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .filled = PTHREAD_COND_INITIALIZER,
+};
+
+/* 后台刷新（stale-while-revalidate）线程的参数。*/
+struct microcache_refresh
+{
+    const struct microcache_rule *rule;
+    struct http_request req;
+    char path[512];
+    char query_str[255];
+    char key[2048];
+};
+
+static unsigned int microcache_hash(const char *key)
+{
+    unsigned int h = 2166136261u;  // FNV-1a
+
+    while (*key)
+    {
+        h ^= (unsigned char)*key++;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static void blob_release(struct cache_blob *blob)
+{
+    if ((NULL != blob) && (0 == __atomic_sub_fetch(&blob->refs, 1, __ATOMIC_ACQ_REL)))
+        free(blob);
+}
+
+static size_t entry_bytes(const struct cache_entry *e)
+{
+    return sizeof(*e) + strlen(e->key) + 1 + (e->blob ? sizeof(*e->blob) + e->blob->len : 0);
+}
+
+/* 以下 microcache_* 内部函数调用者均需持有 microcache.lock。*/
+static void microcache_lru_unlink(struct cache_entry *e)
+{
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        microcache.lru_head = e->lru_next;
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        microcache.lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void microcache_lru_push(struct cache_entry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = microcache.lru_head;
+    if (microcache.lru_head)
+        microcache.lru_head->lru_prev = e;
+    microcache.lru_head = e;
+    if (NULL == microcache.lru_tail)
+        microcache.lru_tail = e;
+}
+
+static struct cache_entry *microcache_find(const char *key, unsigned int hash)
+{
+    struct cache_entry *e;
+
+    for (e = microcache.buckets[hash % MICROCACHE_BUCKETS]; e; e = e->hnext)
+    {
+        if ((e->hash == hash) && (0 == strcmp(e->key, key)))
+            return e;
+    }
+
+    return NULL;
+}
+
+static void microcache_remove(struct cache_entry *e)
+{
+    struct cache_entry **pp = &microcache.buckets[e->hash % MICROCACHE_BUCKETS];
+
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    microcache_lru_unlink(e);
+    microcache.bytes -= entry_bytes(e);
+    microcache.entries--;
+    blob_release(e->blob);
+    free(e->key);
+    free(e);
+}
+
+/* 从 LRU 尾部淘汰条目，直到满足内存预算。正在填充的条目不会被淘汰。*/
+static void microcache_evict(size_t need)
+{
+    struct cache_entry *e = microcache.lru_tail;
+
+    while ((NULL != e) && (microcache.bytes + need > MICROCACHE_MAX_BYTES))
+    {
+        struct cache_entry *prev = e->lru_prev;
+        if (!e->filling)
+        {
+            microcache_remove(e);
+            microcache.evictions++;
+        }
+        e = prev;
+    }
+}
+
+static struct cache_entry *microcache_insert(const char *key, unsigned int hash)
+{
+    struct cache_entry *e = calloc(1, sizeof(*e));
+
+    if (NULL == e)
+        return NULL;
+    if (NULL == (e->key = strdup(key)))
+    {
+        free(e);
+        return NULL;
+    }
+    e->hash = hash;
+    e->filling = 1;
+
+    microcache_evict(entry_bytes(e));
+    e->hnext = microcache.buckets[hash % MICROCACHE_BUCKETS];
+    microcache.buckets[hash % MICROCACHE_BUCKETS] = e;
+    microcache_lru_push(e);
+    microcache.bytes += entry_bytes(e);
+    microcache.entries++;
+
+    return e;
+}
+
+/* 用新的 CGI 输出更新条目，blob 为 NULL 表示本次输出不可缓存。*/
+static void microcache_store(struct cache_entry *e, const struct microcache_rule *rule,
+                             struct cache_blob *blob)
+{
+    microcache.bytes -= entry_bytes(e);
+    blob_release(e->blob);
+    e->blob = blob;
+    e->filling = 0;
+    if (blob)
+    {
+        e->expires_us = now_us() + rule->ttl_ms * 1000LL;
+        e->stale_until_us = e->expires_us + rule->stale_ms * 1000LL;
+    }
+    microcache.bytes += entry_bytes(e);
+    pthread_cond_broadcast(&microcache.filled);
+
+    if (NULL == e->blob)
+        microcache_remove(e);
+    else
+        microcache_evict(0);
+}
+
+/**********************************************************************/
+/* 执行 CGI（GET，无 Request Body），把输出完整读入内存 blob。
+ * 输出超过 MICROCACHE_MAX_ENTRY_BYTES 或 CGI 异常退出时不可缓存：
+ *   - cli_socket_fd >= 0 时，已读取的部分和剩余输出直接流式响应给 Client，*served 置 1；
+ *   - cli_socket_fd < 0（后台刷新）时，丢弃输出。
+ * Returns：
+ *   - 可缓存的 blob（引用计数为 1），不可缓存时返回 NULL。
+ **********************************************************************/
+static struct cache_blob *microcache_run_cgi(intptr_t cli_socket_fd, const struct http_request *req,
+                                             const char *path, const char *query_str, int *served)
+{
+    char buff[4096];
+    size_t cap = 4096;
+    struct cache_blob *blob = malloc(sizeof(*blob) + cap);
+    int cgi_in, cgi_out;
+    ssize_t n;
+
+    *served = 0;
+    if (NULL == blob)
+        return NULL;
+    blob->refs = 1;
+    blob->len = 0;
+
+    TRACE_BEGIN(TRACE_CGI_SPAWN);
+    pid_t pid = cgi_spawn(cli_socket_fd, req, path, query_str, &cgi_in, &cgi_out);
+    TRACE_END(TRACE_CGI_SPAWN);
+    if (FAIL == pid)
+    {
+        if ((EAGAIN == errno) && (cli_socket_fd >= 0))
+        {
+            service_unavailable(cli_socket_fd);
+            *served = 1;
+        }
+        free(blob);
+        return NULL;
+    }
+    close(cgi_in);
+
+    TRACE_BEGIN(TRACE_CGI_OUTPUT);
+    while ((n = read(cgi_out, buff, sizeof(buff))) > 0)
+    {
+        if (blob->len + n > MICROCACHE_MAX_ENTRY_BYTES)
+        {
+            /* 输出过大，放弃缓存，改为直接流式响应。*/
+            if (cli_socket_fd >= 0)
+            {
+                const char *status_line = "HTTP/1.0 200 OK\r\nX-Cache: BYPASS\r\n";
+                send_all(cli_socket_fd, status_line, strlen(status_line));
+                send_all(cli_socket_fd, blob->data, blob->len);
+                send_all(cli_socket_fd, buff, n);
+                while ((n = read(cgi_out, buff, sizeof(buff))) > 0)
+                    send_all(cli_socket_fd, buff, n);
+                *served = 1;
+            }
+            free(blob);
+            blob = NULL;
+            break;
+        }
+        if (blob->len + n > cap)
+        {
+            struct cache_blob *bigger;
+            while (blob->len + n > cap)
+                cap *= 2;
+            if (NULL == (bigger = realloc(blob, sizeof(*blob) + cap)))
+            {
+                free(blob);
+                blob = NULL;
+                break;
+            }
+            blob = bigger;
+        }
+        memcpy(blob->data + blob->len, buff, n);
+        blob->len += n;
+    }
+    close(cgi_out);
+    TRACE_END(TRACE_CGI_OUTPUT);
+
+    int status = cgi_reap(pid);
+    if ((NULL != blob) && (!WIFEXITED(status) || (0 != WEXITSTATUS(status))))
+    {
+        /* CGI 执行失败的输出不缓存，但仍然响应给当前 Client。*/
+        if (cli_socket_fd >= 0)
+        {
+            const char *status_line = "HTTP/1.0 200 OK\r\nX-Cache: BYPASS\r\n";
+            send_all(cli_socket_fd, status_line, strlen(status_line));
+            send_all(cli_socket_fd, blob->data, blob->len);
+            *served = 1;
+        }
+        free(blob);
+        blob = NULL;
+    }
+
+    return blob;
+}
+
+/* 响应缓存的 CGI 输出，并附带 X-Cache 缓存状态 Header。*/
+static void microcache_send(intptr_t cli_socket_fd, const struct cache_blob *blob, const char *cache_status)
+{
+    char buff[128];
+
+    snprintf(buff, sizeof(buff), "HTTP/1.0 200 OK\r\nX-Cache: %s\r\n", cache_status);
+    if (SUCCESS == send_all(cli_socket_fd, buff, strlen(buff)))
+        send_all(cli_socket_fd, blob->data, blob->len);
+}
+
+/* 不经过缓存执行 CGI（key 过长、等待超时等），响应同样带有 X-Cache Header。*/
+static void microcache_bypass(intptr_t cli_socket_fd, const struct http_request *req,
+                              const char *path, const char *query_str)
+{
+    int served;
+    struct cache_blob *blob;
+
+    pthread_mutex_lock(&microcache.lock);
+    microcache.bypass++;
+    pthread_mutex_unlock(&microcache.lock);
+
+    blob = microcache_run_cgi(cli_socket_fd, req, path, query_str, &served);
+    if (NULL != blob)
+    {
+        microcache_send(cli_socket_fd, blob, "BYPASS");
+        blob_release(blob);
+    }
+    else if (!served)
+    {
+        cannot_execute(cli_socket_fd);
+    }
+}
+
+/* 条目是否有可以响应的内容：新鲜，或者仍在 stale 期内。调用者需持有 microcache.lock。*/
+static int microcache_usable(const struct cache_entry *e, long long now)
+{
+    return (NULL != e->blob) && (now < e->stale_until_us);
+}
+
+/* 后台刷新线程：重新执行 CGI 并替换过期条目的响应。*/
+static void *microcache_refresh(void *arg)
+{
+    struct microcache_refresh *job = arg;
+    int served;
+
+    struct cache_blob *blob = microcache_run_cgi(-1, &job->req, job->path, job->query_str, &served);
+
+    pthread_mutex_lock(&microcache.lock);
+    struct cache_entry *e = microcache_find(job->key, microcache_hash(job->key));
+    if ((NULL != e) && e->filling)
+    {
+        if (NULL != blob)
+        {
+            microcache_store(e, job->rule, blob);
+            blob = NULL;
+        }
+        else
+        {
+            e->filling = 0;  // 刷新失败，保留旧响应直到 stale 期结束。
+            pthread_cond_broadcast(&microcache.filled);
+        }
+    }
+    pthread_mutex_unlock(&microcache.lock);
+
+    blob_release(blob);
+    free(job);
+    return NULL;
+}
+
+/**********************************************************************/
+/* 查找请求对应的微缓存规则，只有 GET 且不带 Cookie/Authorization 的请求可以缓存。
+ * Returns：
+ *   - 匹配的规则，没有匹配时返回 NULL。
+ **********************************************************************/
+const struct microcache_rule *microcache_match(const char *url, const struct http_request *req)
+{
+    size_t i;
+
+    if (strcasecmp(req->method, "GET") || get_header(req, "Cookie") || get_header(req, "Authorization"))
+        return NULL;
+
+    for (i = 0; i < NUM_MICROCACHE_RULES; i++)
+    {
+        if (0 == strcmp(url, microcache_rules[i].path))
+            return &microcache_rules[i];
+    }
+
+    return NULL;
+}
+
+/**********************************************************************/
+/* 通过微缓存响应 CGI 请求。缓存 key 为 path + query string + vary Headers。
+ *   - HIT：新鲜的缓存直接响应；
+ *   - STALE：过期但仍在 stale 期内，返回旧响应，并由后台线程刷新；
+ *   - MISS：执行 CGI 并填充缓存，同一 key 的并发请求等待这一次执行的结果（请求合并）。
+ **********************************************************************/
+void microcache_serve(intptr_t cli_socket_fd, const struct http_request *req,
+                      const struct microcache_rule *rule, const char *path, const char *query_str)
+{
+    char key[2048];
+    size_t len;
+    int i;
+
+    len = snprintf(key, sizeof(key), "%s?%s", rule->path, query_str ? query_str : "");
+    for (i = 0; (i < MICROCACHE_MAX_VARY) && rule->vary[i] && (len < sizeof(key)); i++)
+    {
+        const char *value = get_header(req, rule->vary[i]);
+        len += snprintf(key + len, sizeof(key) - len, "\n%s:%s", rule->vary[i], value ? value : "");
+    }
+    if (len >= sizeof(key))
+    {
+        microcache_bypass(cli_socket_fd, req, path, query_str);
+        return;
+    }
+    unsigned int hash = microcache_hash(key);
+
+    pthread_mutex_lock(&microcache.lock);
+    struct cache_entry *e = microcache_find(key, hash);
+    int waited = 0;
+
+    /* 请求合并：同一 key 正在执行 CGI（首次填充，或者旧响应已经超过 stale 期的刷新），等待其结果。*/
+    if ((NULL != e) && e->filling && !microcache_usable(e, now_us()))
+        TRACE_BEGIN(TRACE_CACHE_WAIT);
+    while ((NULL != e) && e->filling && !microcache_usable(e, now_us()))
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += MICROCACHE_WAIT_MS / 1000;
+        deadline.tv_nsec += (MICROCACHE_WAIT_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        waited = 1;
+        int rc = pthread_cond_timedwait(&microcache.filled, &microcache.lock, &deadline);
+        e = microcache_find(key, hash);  // 等待期间条目可能已被淘汰。
+        if (ETIMEDOUT == rc)
+            break;
+    }
+    if (waited)
+        TRACE_END(TRACE_CACHE_WAIT);
+
+    long long now = now_us();
+    if ((NULL != e) && microcache_usable(e, now))
+    {
+        struct cache_blob *blob = e->blob;
+        const char *cache_status = "HIT";
+        struct microcache_refresh *job = NULL;
+
+        __atomic_add_fetch(&blob->refs, 1, __ATOMIC_ACQ_REL);
+        microcache_lru_unlink(e);
+        microcache_lru_push(e);
+
+        if (now >= e->expires_us)
+        {
+            /* stale-while-revalidate：只有一个线程负责后台刷新。*/
+            cache_status = "STALE";
+            microcache.stale++;
+            if (!e->filling && (NULL != (job = malloc(sizeof(*job)))))
+            {
+                e->filling = 1;
+                job->rule = rule;
+                job->req = *req;
+                snprintf(job->path, sizeof(job->path), "%s", path);
+                snprintf(job->query_str, sizeof(job->query_str), "%s", query_str ? query_str : "");
+                snprintf(job->key, sizeof(job->key), "%s", key);
+            }
+        }
+        else if (waited)
+        {
+            microcache.coalesced++;
+        }
+        else
+        {
+            microcache.hits++;
+        }
+        pthread_mutex_unlock(&microcache.lock);
+
+        if (NULL != job)
+        {
+            pthread_t refresh_thread;
+            if (pthread_create(&refresh_thread, NULL, microcache_refresh, job) == 0)
+            {
+                pthread_detach(refresh_thread);
+            }
+            else
+            {
+                pthread_mutex_lock(&microcache.lock);
+                if (NULL != (e = microcache_find(key, hash)))
+                    e->filling = 0;
+                pthread_mutex_unlock(&microcache.lock);
+                free(job);
+            }
+        }
+
+        microcache_send(cli_socket_fd, blob, cache_status);
+        blob_release(blob);
+        return;
+    }
+
+    /* MISS：由当前线程执行 CGI 并填充缓存。等待超时时不再合并，直接执行。*/
+    if ((NULL != e) && e->filling)
+    {
+        pthread_mutex_unlock(&microcache.lock);
+        microcache_bypass(cli_socket_fd, req, path, query_str);
+        return;
+    }
+    if (NULL != e)
+    {
+        /* 超过 stale 期的旧响应不会再被使用，立即释放，之后的请求等待本次填充。*/
+        microcache.bytes -= entry_bytes(e);
+        blob_release(e->blob);
+        e->blob = NULL;
+        microcache.bytes += entry_bytes(e);
+        e->filling = 1;
+    }
+    else
+    {
+        e = microcache_insert(key, hash);
+    }
+    if (NULL != e)
+        microcache.misses++;
+    pthread_mutex_unlock(&microcache.lock);
+
+    if (NULL == e)
+    {
+        microcache_bypass(cli_socket_fd, req, path, query_str);
+        return;
+    }
+
+    int served;
+    struct cache_blob *blob = microcache_run_cgi(cli_socket_fd, req, path, query_str, &served);
+
+    pthread_mutex_lock(&microcache.lock);
+    if (NULL != blob)
+        __atomic_add_fetch(&blob->refs, 1, __ATOMIC_ACQ_REL);
+    microcache_store(e, rule, blob);
+    pthread_mutex_unlock(&microcache.lock);
+
+    if (NULL != blob)
+    {
+        microcache_send(cli_socket_fd, blob, "MISS");
+        blob_release(blob);
+    }
+    else if (!served)
+    {
+        cannot_execute(cli_socket_fd);
+    }
+}
+
+/* 状态页面：输出微缓存的命中率、内存占用等指标。*/
+void microcache_status(intptr_t cli_socket_fd)
+{
+    char buff[1024];
+
+    pthread_mutex_lock(&microcache.lock);
+    snprintf(buff, sizeof(buff),
+             "entries=%lu bytes=%zu max_bytes=%d hits=%lu misses=%lu stale=%lu "
+             "coalesced=%lu bypass=%lu evictions=%lu\n",
+             microcache.entries, microcache.bytes, MICROCACHE_MAX_BYTES, microcache.hits,
+             microcache.misses, microcache.stale, microcache.coalesced, microcache.bypass,
+             microcache.evictions);
+    pthread_mutex_unlock(&microcache.lock);
+
+    send_all(cli_socket_fd, buff, strlen(buff));
+}
+
+
+
+/*************************
+ * HTTP/2 (h2c)
+ *************************/
+
+/* HTTP/2 规格参数。*/
+#define H2_MAX_STREAMS        32                  // SETTINGS_MAX_CONCURRENT_STREAMS
+#define H2_FRAME_SIZE         16384               // 本端收发帧的最大长度（协议默认值）。
+#define H2_INITIAL_WINDOW     65535               // 协议默认的流量控制窗口。
+#define H2_MAX_WINDOW         0x7fffffffLL
+#define H2_HEADER_TABLE_SIZE  4096                // HPACK 动态表大小上限。
+#define H2_MAX_HEADER_BLOCK   (64 * 1024)         // HEADERS + CONTINUATION 累积的上限。
+#define H2_MAX_BUFFERED_BODY  (1024 * 1024)       // 没有 content-length 的 Request Body 最多缓冲的字节数。
+#define H2_IDLE_TIMEOUT_MS    60000               // 连接上没有任何帧和 Response 数据时的空闲超时。
+
+#define H2_PREFACE      "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN  24
+
+/* 帧类型。*/
+#define H2_DATA           0x0
+#define H2_HEADERS        0x1
+#define H2_PRIORITY       0x2
+#define H2_RST_STREAM     0x3
+#define H2_SETTINGS       0x4
+#define H2_PUSH_PROMISE   0x5
+#define H2_PING           0x6
+#define H2_GOAWAY         0x7
+#define H2_WINDOW_UPDATE  0x8
+#define H2_CONTINUATION   0x9
+
+/* 帧标志。*/
+#define H2_FLAG_END_STREAM   0x1
+#define H2_FLAG_ACK          0x1
+#define H2_FLAG_END_HEADERS  0x4
+#define H2_FLAG_PADDED       0x8
+#define H2_FLAG_PRIORITY     0x20
+
+/* 错误码。*/
+#define H2_NO_ERROR            0x0
+#define H2_PROTOCOL_ERROR      0x1
+#define H2_INTERNAL_ERROR      0x2
+#define H2_FLOW_CONTROL_ERROR  0x3
+#define H2_STREAM_CLOSED       0x5
+#define H2_FRAME_SIZE_ERROR    0x6
+#define H2_REFUSED_STREAM      0x7
+#define H2_COMPRESSION_ERROR   0x9
+
+/* SETTINGS 参数。*/
+#define H2_SETTINGS_HEADER_TABLE_SIZE       0x1
+#define H2_SETTINGS_ENABLE_PUSH             0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS  0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE     0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE          0x5
+
+/**********************************************************************/
+/* HPACK（RFC 7541）：静态表 + 动态表，解码支持 Huffman，编码只输出原始字符串。
+ **********************************************************************/
+#define HPACK_STATIC_ENTRIES  61
+#define HPACK_MAX_ENTRIES     (H2_HEADER_TABLE_SIZE / 32)  // 每个条目至少占用 32 字节。
+#define HPACK_MAX_STRING      8192
+
+struct hpack_header
+{
+    const char *name;
+    const char *value;
+};
+
+static const struct hpack_header hpack_static_table[HPACK_STATIC_ENTRIES] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+/* RFC 7541 Appendix B 的 Huffman 编码表（不含 EOS）。*/
+static const unsigned int hpack_huff_codes[256] = {
+    0x00001ff8, 0x007fffd8, 0x0fffffe2, 0x0fffffe3, 0x0fffffe4, 0x0fffffe5,
+    0x0fffffe6, 0x0fffffe7, 0x0fffffe8, 0x00ffffea, 0x3ffffffc, 0x0fffffe9,
+    0x0fffffea, 0x3ffffffd, 0x0fffffeb, 0x0fffffec, 0x0fffffed, 0x0fffffee,
+    0x0fffffef, 0x0ffffff0, 0x0ffffff1, 0x0ffffff2, 0x3ffffffe, 0x0ffffff3,
+    0x0ffffff4, 0x0ffffff5, 0x0ffffff6, 0x0ffffff7, 0x0ffffff8, 0x0ffffff9,
+    0x0ffffffa, 0x0ffffffb, 0x00000014, 0x000003f8, 0x000003f9, 0x00000ffa,
+    0x00001ff9, 0x00000015, 0x000000f8, 0x000007fa, 0x000003fa, 0x000003fb,
+    0x000000f9, 0x000007fb, 0x000000fa, 0x00000016, 0x00000017, 0x00000018,
+    0x00000000, 0x00000001, 0x00000002, 0x00000019, 0x0000001a, 0x0000001b,
+    0x0000001c, 0x0000001d, 0x0000001e, 0x0000001f, 0x0000005c, 0x000000fb,
+    0x00007ffc, 0x00000020, 0x00000ffb, 0x000003fc, 0x00001ffa, 0x00000021,
+    0x0000005d, 0x0000005e, 0x0000005f, 0x00000060, 0x00000061, 0x00000062,
+    0x00000063, 0x00000064, 0x00000065, 0x00000066, 0x00000067, 0x00000068,
+    0x00000069, 0x0000006a, 0x0000006b, 0x0000006c, 0x0000006d, 0x0000006e,
+    0x0000006f, 0x00000070, 0x00000071, 0x00000072, 0x000000fc, 0x00000073,
+    0x000000fd, 0x00001ffb, 0x0007fff0, 0x00001ffc, 0x00003ffc, 0x00000022,
+    0x00007ffd, 0x00000003, 0x00000023, 0x00000004, 0x00000024, 0x00000005,
+    0x00000025, 0x00000026, 0x00000027, 0x00000006, 0x00000074, 0x00000075,
+    0x00000028, 0x00000029, 0x0000002a, 0x00000007, 0x0000002b, 0x00000076,
+    0x0000002c, 0x00000008, 0x00000009, 0x0000002d, 0x00000077, 0x00000078,
+    0x00000079, 0x0000007a, 0x0000007b, 0x00007ffe, 0x000007fc, 0x00003ffd,
+    0x00001ffd, 0x0ffffffc, 0x000fffe6, 0x003fffd2, 0x000fffe7, 0x000fffe8,
+    0x003fffd3, 0x003fffd4, 0x003fffd5, 0x007fffd9, 0x003fffd6, 0x007fffda,
+    0x007fffdb, 0x007fffdc, 0x007fffdd, 0x007fffde, 0x00ffffeb, 0x007fffdf,
+    0x00ffffec, 0x00ffffed, 0x003fffd7, 0x007fffe0, 0x00ffffee, 0x007fffe1,
+    0x007fffe2, 0x007fffe3, 0x007fffe4, 0x001fffdc, 0x003fffd8, 0x007fffe5,
+    0x003fffd9, 0x007fffe6, 0x007fffe7, 0x00ffffef, 0x003fffda, 0x001fffdd,
+    0x000fffe9, 0x003fffdb, 0x003fffdc, 0x007fffe8, 0x007fffe9, 0x001fffde,
+    0x007fffea, 0x003fffdd, 0x003fffde, 0x00fffff0, 0x001fffdf, 0x003fffdf,
+    0x007fffeb, 0x007fffec, 0x001fffe0, 0x001fffe1, 0x003fffe0, 0x001fffe2,
+    0x007fffed, 0x003fffe1, 0x007fffee, 0x007fffef, 0x000fffea, 0x003fffe2,
+    0x003fffe3, 0x003fffe4, 0x007ffff0, 0x003fffe5, 0x003fffe6, 0x007ffff1,
+    0x03ffffe0, 0x03ffffe1, 0x000fffeb, 0x0007fff1, 0x003fffe7, 0x007ffff2,
+    0x003fffe8, 0x01ffffec, 0x03ffffe2, 0x03ffffe3, 0x03ffffe4, 0x07ffffde,
+    0x07ffffdf, 0x03ffffe5, 0x00fffff1, 0x01ffffed, 0x0007fff2, 0x001fffe3,
+    0x03ffffe6, 0x07ffffe0, 0x07ffffe1, 0x03ffffe7, 0x07ffffe2, 0x00fffff2,
+    0x001fffe4, 0x001fffe5, 0x03ffffe8, 0x03ffffe9, 0x0ffffffd, 0x07ffffe3,
+    0x07ffffe4, 0x07ffffe5, 0x000fffec, 0x00fffff3, 0x000fffed, 0x001fffe6,
+    0x003fffe9, 0x001fffe7, 0x001fffe8, 0x007ffff3, 0x003fffea, 0x003fffeb,
+    0x01ffffee, 0x01ffffef, 0x00fffff4, 0x00fffff5, 0x03ffffea, 0x007ffff4,
+    0x03ffffeb, 0x07ffffe6, 0x03ffffec, 0x03ffffed, 0x07ffffe7, 0x07ffffe8,
+    0x07ffffe9, 0x07ffffea, 0x07ffffeb, 0x0ffffffe, 0x07ffffec, 0x07ffffed,
+    0x07ffffee, 0x07ffffef, 0x07fffff0, 0x03ffffee,
+};
+
+static const unsigned char hpack_huff_lens[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+/* 动态表条目，entries[0] 为最新插入的条目。*/
+struct hpack_entry
+{
+    char *name;
+    char *value;
+    size_t size;  // RFC 7541 4.1：name 长度 + value 长度 + 32。
+};
+
+struct hpack_table
+{
+    struct hpack_entry entries[HPACK_MAX_ENTRIES];
+    int count;
+    size_t size;
+    size_t max_size;
+};
+
+/* Huffman 解码树：>0 为子节点下标，<0 为叶子 -(sym + 1)，0 表示无效路径。*/
+static short hpack_huff_tree[512][2];
+static pthread_once_t hpack_huff_once = PTHREAD_ONCE_INIT;
+
+static void hpack_huff_build(void)
+{
+    int nodes = 1;
+    int sym, bit;
+
+    for (sym = 0; sym < 256; sym++)
+    {
+        unsigned int code = hpack_huff_codes[sym];
+        int node = 0;
+
+        for (bit = hpack_huff_lens[sym] - 1; bit > 0; bit--)
+        {
+            int b = (code >> bit) & 1;
+            if (0 == hpack_huff_tree[node][b])
+                hpack_huff_tree[node][b] = nodes++;
+            node = hpack_huff_tree[node][b];
+        }
+        hpack_huff_tree[node][code & 1] = -(sym + 1);
+    }
+}
+
+/* Huffman 解码。结尾的填充必须是不超过 7 位的 EOS 前缀（全 1）。*/
+static int hpack_huff_decode(const unsigned char *in, size_t len, char *out, size_t size)
+{
+    size_t i, n = 0;
+    int node = 0;
+    int pad_bits = 0;
+    int pad_ones = 1;
+    int bit;
+
+    pthread_once(&hpack_huff_once, hpack_huff_build);
+    for (i = 0; i < len; i++)
+    {
+        for (bit = 7; bit >= 0; bit--)
+        {
+            int b = (in[i] >> bit) & 1;
+            node = hpack_huff_tree[node][b];
+            if (0 == node)
+                return FAIL;
+            if (node < 0)
+            {
+                if (n + 1 >= size)
+                    return FAIL;
+                out[n++] = (char)(-node - 1);
+                node = 0;
+                pad_bits = 0;
+                pad_ones = 1;
+            }
+            else
+            {
+                pad_bits++;
+                pad_ones &= b;
+            }
+        }
+    }
+    if ((0 != node) && ((pad_bits > 7) || !pad_ones))
+        return FAIL;
+
+    out[n] = '\0';
+    return (int)n;
+}
+
+static void hpack_table_init(struct hpack_table *t, size_t max_size)
+{
+    memset(t, 0, sizeof(*t));
+    t->max_size = max_size;
+}
+
+static void hpack_table_evict(struct hpack_table *t, size_t need)
+{
+    while ((t->count > 0) && (t->size + need > t->max_size))
+    {
+        struct hpack_entry *e = &t->entries[--t->count];
+        t->size -= e->size;
+        free(e->name);
+        free(e->value);
+    }
+}
+
+static void hpack_table_resize(struct hpack_table *t, size_t max_size)
+{
+    t->max_size = max_size;
+    hpack_table_evict(t, 0);
+}
+
+static void hpack_table_free(struct hpack_table *t)
+{
+    hpack_table_resize(t, 0);
+}
+
+static void hpack_table_add(struct hpack_table *t, const char *name, const char *value)
+{
+    size_t size = strlen(name) + strlen(value) + 32;
+
+    hpack_table_evict(t, size);
+    if ((size > t->max_size) || (t->count >= HPACK_MAX_ENTRIES))
+        return;  // 比整个表还大的条目会清空动态表，且不会被加入。
+
+    char *n = strdup(name);
+    char *v = strdup(value);
+    if ((NULL == n) || (NULL == v))
+    {
+        free(n);
+        free(v);
+        return;
+    }
+    memmove(&t->entries[1], &t->entries[0], t->count * sizeof(t->entries[0]));
+    t->entries[0].name = n;
+    t->entries[0].value = v;
+    t->entries[0].size = size;
+    t->count++;
+    t->size += size;
+}
+
+/* 按 HPACK 索引（从 1 开始，先静态表后动态表）查找条目。*/
+static int hpack_table_get(const struct hpack_table *t, uint32_t index, const char **name, const char **value)
+{
+    if ((index >= 1) && (index <= HPACK_STATIC_ENTRIES))
+    {
+        *name = hpack_static_table[index - 1].name;
+        *value = hpack_static_table[index - 1].value;
+        return SUCCESS;
+    }
+    if ((index > HPACK_STATIC_ENTRIES) && (index - HPACK_STATIC_ENTRIES <= (uint32_t)t->count))
+    {
+        *name = t->entries[index - HPACK_STATIC_ENTRIES - 1].name;
+        *value = t->entries[index - HPACK_STATIC_ENTRIES - 1].value;
+        return SUCCESS;
+    }
+
+    return FAIL;
+}
+
+static int hpack_decode_int(const unsigned char **pp, const unsigned char *end, int prefix, uint32_t *out)
+{
+    const unsigned char *p = *pp;
+    uint32_t max = (1u << prefix) - 1;
+    uint64_t v;
+    int shift = 0;
+    unsigned char b;
+
+    if (p >= end)
+        return FAIL;
+    v = *p++ & max;
+    if (v == max)
+    {
+        do
+        {
+            if ((p >= end) || (shift > 21))
+                return FAIL;
+            b = *p++;
+            v += (uint64_t)(b & 0x7f) << shift;
+            shift += 7;
+        } while (b & 0x80);
+    }
+
+    *pp = p;
+    *out = (uint32_t)v;
+    return SUCCESS;
+}
+
+static int hpack_decode_str(const unsigned char **pp, const unsigned char *end, char *out, size_t size)
+{
+    const unsigned char *p = *pp;
+    uint32_t len;
+    int huffman;
+
+    if (p >= end)
+        return FAIL;
+    huffman = *p & 0x80;
+    if ((FAIL == hpack_decode_int(&p, end, 7, &len)) || (len > (size_t)(end - p)))
+        return FAIL;
+
+    if (huffman)
+    {
+        if (FAIL == hpack_huff_decode(p, len, out, size))
+            return FAIL;
+    }
+    else
+    {
+        if (len >= size)
+            return FAIL;
+        memcpy(out, p, len);
+        out[len] = '\0';
+    }
+
+    *pp = p + len;
+    return SUCCESS;
+}
+
+/**********************************************************************/
+/* 解码一个完整的 Header Block，每解出一个 Header 调用一次 cb。
+ * 即使 Stream 随后被拒绝，也必须完整解码以保持动态表与对端同步。
+ * Returns：
+ *   - SUCCESS，解码失败返回 FAIL（连接级 COMPRESSION_ERROR）。
+ **********************************************************************/
+static int hpack_decode(struct hpack_table *t, const unsigned char *p, size_t len,
+                        void (*cb)(void *arg, const char *name, const char *value), void *arg)
+{
+    const unsigned char *end = p + len;
+    char *name = malloc(HPACK_MAX_STRING);
+    char *value = malloc(HPACK_MAX_STRING);
+    int rc = SUCCESS;
+    uint32_t index;
+
+    if ((NULL == name) || (NULL == value))
+    {
+        free(name);
+        free(value);
+        return FAIL;
+    }
+
+    while ((SUCCESS == rc) && (p < end))
+    {
+        const char *n, *v;
+
+        if (*p & 0x80)
+        {   /* Indexed Header Field */
+            if ((FAIL == hpack_decode_int(&p, end, 7, &index)) || (FAIL == hpack_table_get(t, index, &n, &v)))
+                rc = FAIL;
+            else
+                cb(arg, n, v);
+        }
+        else if ((*p & 0xe0) == 0x20)
+        {   /* Dynamic Table Size Update */
+            if ((FAIL == hpack_decode_int(&p, end, 5, &index)) || (index > H2_HEADER_TABLE_SIZE))
+                rc = FAIL;
+            else
+                hpack_table_resize(t, index);
+        }
+        else
+        {   /* Literal Header Field：with incremental indexing (01)、without indexing (0000)、never indexed (0001) */
+            int incremental = ((*p & 0xc0) == 0x40);
+            if (FAIL == hpack_decode_int(&p, end, incremental ? 6 : 4, &index))
+            {
+                rc = FAIL;
+                break;
+            }
+            if (index > 0)
+            {
+                if (FAIL == hpack_table_get(t, index, &n, &v))
+                {
+                    rc = FAIL;
+                    break;
+                }
+                snprintf(name, HPACK_MAX_STRING, "%s", n);
+            }
+            else if (FAIL == hpack_decode_str(&p, end, name, HPACK_MAX_STRING))
+            {
+                rc = FAIL;
+                break;
+            }
+            if (FAIL == hpack_decode_str(&p, end, value, HPACK_MAX_STRING))
+            {
+                rc = FAIL;
+                break;
+            }
+            if (incremental)
+                hpack_table_add(t, name, value);
+            cb(arg, name, value);
+        }
+    }
+
+    free(name);
+    free(value);
+    return rc;
+}
+
+static size_t hpack_encode_int(unsigned char *out, uint32_t v, int prefix, unsigned char first)
+{
+    uint32_t max = (1u << prefix) - 1;
+    size_t n = 0;
+
+    if (v < max)
+    {
+        out[n++] = first | v;
+        return n;
+    }
+    out[n++] = first | max;
+    v -= max;
+    while (v >= 0x80)
+    {
+        out[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    out[n++] = v;
+
+    return n;
+}
+
+static size_t hpack_encode_str(unsigned char *out, const char *s)
+{
+    size_t len = strlen(s);
+    size_t n = hpack_encode_int(out, len, 7, 0x00);
+
+    memcpy(out + n, s, len);
+    return n + len;
+}
+
+/**********************************************************************/
+/* 编码一个 Response Header：
+ *   - 静态表或动态表中完全匹配：Indexed Header Field；
+ *   - 否则 Literal with incremental indexing（可复用表中的 name），并加入动态表；
+ *   - indexable 为 0 的 Header（e.g. content-length）使用 Literal without indexing。
+ * Returns：
+ *   - 写入 out 的字节数，空间不足时返回 0。
+ **********************************************************************/
+static size_t hpack_encode_header(struct hpack_table *t, unsigned char *out, size_t avail,
+                                  const char *name, const char *value, int indexable)
+{
+    uint32_t name_index = 0;
+    uint32_t i;
+    size_t n = 0;
+    const char *en, *ev;
+
+    if (strlen(name) + strlen(value) + 16 > avail)
+        return 0;
+
+    for (i = 1; i <= (uint32_t)(HPACK_STATIC_ENTRIES + t->count); i++)
+    {
+        hpack_table_get(t, i, &en, &ev);
+        if (strcmp(en, name))
+            continue;
+        if (0 == strcmp(ev, value))
+            return hpack_encode_int(out, i, 7, 0x80);
+        if (0 == name_index)
+            name_index = i;
+    }
+
+    if (indexable)
+        n = hpack_encode_int(out, name_index, 6, 0x40);
+    else
+        n = hpack_encode_int(out, name_index, 4, 0x00);
+    if (0 == name_index)
+        n += hpack_encode_str(out + n, name);
+    n += hpack_encode_str(out + n, value);
+
+    if (indexable)
+        hpack_table_add(t, name, value);
+
+    return n;
+}
+
+/**********************************************************************/
+/* HTTP/2 连接与 Stream。
+ * 每个 Stream 通过一对 socketpair 交给一个普通的处理线程（request_handle()），
+ * 静态文件、CGI、反向代理、上传等处理逻辑无需修改：
+ *   HEADERS/DATA -> HTTP/1.1 Request -> socketpair -> request_handle()
+ *   request_handle() -> HTTP/1.x Response -> socketpair -> HEADERS/DATA
+ **********************************************************************/
+
+/* Response 中 chunked Body 的解码状态。*/
+#define H2_CHUNK_SIZE     0
+#define H2_CHUNK_DATA     1
+#define H2_CHUNK_CRLF     2
+#define H2_CHUNK_TRAILER  3
+#define H2_CHUNK_DONE     4
+
+struct h2_stream
+{
+    int in_use;
+    uint32_t id;
+    int fd;                     // socketpair 本端，-1 表示处理线程尚未启动或者已经结束。
+    int started;
+    int remote_closed;          // 已收到 Client 的 END_STREAM。
+    long long send_window;
+
+    /* Request：等待 END_STREAM 才能确定长度的 Body 先缓冲在这里。*/
+    char *req_head;
+    size_t req_head_len;
+    char *body;
+    size_t body_len;
+    char *in;                   // 还没有写入 socketpair 的 Body：启动前缓冲的完整 Body，或者启动后收到的数据（容量为 H2_INITIAL_WINDOW）。
+    size_t in_len;
+    int in_chunked;             // 长度未知的上传：Body 以 chunked 编码写入 socketpair，不必等待 END_STREAM。
+    char in_frame[32];          // 待写入的 chunk 分隔：chunk-size CRLF、chunk-data 之后的 CRLF 或者 last-chunk。
+    size_t in_frame_len;
+    size_t in_frame_off;
+    size_t in_chunk_left;       // 当前 chunk 中还没有写入的数据，位于 in 的开头。
+    int in_last_chunk;          // 已经排入 last-chunk。
+
+    /* Response */
+    int head_done;
+    char resp_head[8192];
+    size_t resp_head_len;
+    char pending[8192];         // 已解码、等待流量控制窗口的 Body 数据。
+    size_t pending_len;
+    int resp_eof;
+    int chunked;
+    int chunk_state;
+    long long chunk_left;
+    char chunk_line[64];
+    size_t chunk_line_len;
+};
+
+struct h2_conn
+{
+    int fd;
+    int need_preface;           // h2c Upgrade 之后，Client Preface 还没有读取。
+    int goaway;
+    uint32_t last_stream_id;
+    long long send_window;
+    long long peer_initial_window;
+    struct hpack_table dec;
+    struct hpack_table enc;
+    int enc_size_update;        // 下一个 Header Block 需要先发送动态表大小更新。
+
+    /* 正在接收的 Header Block（HEADERS + CONTINUATION）。*/
+    uint32_t hblock_stream;
+    int hblock_end_stream;
+    size_t hblock_len;
+    unsigned char hblock[H2_MAX_HEADER_BLOCK];
+
+    size_t rbuf_len;
+    unsigned char rbuf[9 + H2_FRAME_SIZE];
+    unsigned char wbuf[9 + H2_FRAME_SIZE];
+
+    struct h2_stream streams[H2_MAX_STREAMS];
+};
+
+static void *request_thread(void *arg);
+static int set_sock_non_blocking(int sock_fd);
+static int h2_stream_write(struct h2_conn *c, struct h2_stream *s);
+
+static int h2_send_frame(struct h2_conn *c, int type, int flags, uint32_t stream_id,
+                         const void *payload, size_t len)
+{
+    c->wbuf[0] = (len >> 16) & 0xff;
+    c->wbuf[1] = (len >> 8) & 0xff;
+    c->wbuf[2] = len & 0xff;
+    c->wbuf[3] = type;
+    c->wbuf[4] = flags;
+    c->wbuf[5] = (stream_id >> 24) & 0x7f;
+    c->wbuf[6] = (stream_id >> 16) & 0xff;
+    c->wbuf[7] = (stream_id >> 8) & 0xff;
+    c->wbuf[8] = stream_id & 0xff;
+    if (len > 0)
+        memcpy(c->wbuf + 9, payload, len);
+
+    return send_all(c->fd, c->wbuf, 9 + len);
+}
+
+static void h2_put32(unsigned char *p, uint32_t v)
+{
+    p[0] = (v >> 24) & 0xff;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
+
+static uint32_t h2_get32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void h2_goaway(struct h2_conn *c, uint32_t error)
+{
+    unsigned char payload[8];
+
+    h2_put32(payload, c->last_stream_id);
+    h2_put32(payload + 4, error);
+    h2_send_frame(c, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    c->goaway = 1;
+}
+
+static void h2_rst_stream(struct h2_conn *c, uint32_t stream_id, uint32_t error)
+{
+    unsigned char payload[4];
+
+    h2_put32(payload, error);
+    h2_send_frame(c, H2_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+static void h2_window_update(struct h2_conn *c, uint32_t stream_id, uint32_t increment)
+{
+    unsigned char payload[4];
+
+    h2_put32(payload, increment);
+    h2_send_frame(c, H2_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+static struct h2_stream *h2_find_stream(struct h2_conn *c, uint32_t id)
+{
+    int i;
+
+    for (i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        if (c->streams[i].in_use && (c->streams[i].id == id))
+            return &c->streams[i];
+    }
+
+    return NULL;
+}
+
+static int h2_active_streams(const struct h2_conn *c)
+{
+    int i, n = 0;
+
+    for (i = 0; i < H2_MAX_STREAMS; i++)
+        n += c->streams[i].in_use;
+
+    return n;
+}
+
+/* 关闭 Stream：关闭 socketpair 后处理线程的读写会失败并自行退出。*/
+static void h2_close_stream(struct h2_stream *s)
+{
+    if (s->fd >= 0)
+        close(s->fd);
+    free(s->req_head);
+    free(s->body);
+    free(s->in);
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+}
+
+/**********************************************************************/
+/* 启动 Stream 的处理线程：通过 socketpair 把转换后的 HTTP/1.1 Request
+ * 交给 request_thread()，处理线程看到的是一个普通的 Client 连接。
+ **********************************************************************/
+static int h2_start_stream(struct h2_conn *c, struct h2_stream *s)
+{
+    int sv[2];
+    pthread_t thread;
+
+    if (FAIL == socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv))
+        return FAIL;
+    /* 处理线程还没有启动，这里只写入 Request Header；Body 可能超过 socketpair 的缓冲区，
+     * 交给 h2_stream_write() 在处理线程读取时逐步写入。*/
+    if ((sv[1] >= MAX_CONNS) || (SUCCESS != send_all(sv[0], s->req_head, s->req_head_len)))
+    {
+        close(sv[0]);
+        close(sv[1]);
+        return FAIL;
+    }
+
+    /* 处理线程通过 conn_table 获取 Client 地址（X-Forwarded-For、REMOTE_ADDR 等）。
+     * socketpair 上是明文：HTTP/2 over kTLS 时 TLS 握手已经在 Client 连接上完成，不能再次握手。*/
+    if (c->fd < MAX_CONNS)
+        conn_table[sv[1]] = conn_table[c->fd];
+    conn_table[sv[1]].tls = 0;
+    conn_table[sv[1]].trace_sampled = 0;
+    conn_table[sv[1]].ratelimit_charged = 0;  // 每个 Stream 都是一个新的 Request。
+    conn_table[sv[1]].ssl = NULL;
+
+    if (pthread_create(&thread, NULL, request_thread, (void *)(intptr_t)sv[1]) != 0)
+    {
+        close(sv[0]);
+        close(sv[1]);
+        return FAIL;
+    }
+    pthread_detach(thread);
+
+    set_sock_non_blocking(sv[0]);
+    s->fd = sv[0];
+    s->started = 1;
+    /* 缓冲的 Body 只在收到 END_STREAM 后才会启动，之后不会再追加数据，可以直接作为待写入的缓冲区。*/
+    s->in = s->body;
+    s->in_len = s->body_len;
+    s->body = NULL;
+    s->body_len = 0;
+
+    return h2_stream_write(c, s);
+}
+
+/* 把 HPACK 解码出的 Request Headers 转换成 HTTP/1.1 Request 文本。*/
+struct h2_request_builder
+{
+    char method[32];
+    char path[1024];
+    char authority[256];
+    char cookie[4096];
+    char headers[8192];
+    size_t headers_len;
+    long long content_len;
+    int error;
+};
+
+static void h2_collect_header(void *arg, const char *name, const char *value)
+{
+    struct h2_request_builder *b = arg;
+
+    if (':' == name[0])
+    {
+        if (0 == strcmp(name, ":method"))
+            snprintf(b->method, sizeof(b->method), "%s", value);
+        else if (0 == strcmp(name, ":path"))
+            snprintf(b->path, sizeof(b->path), "%s", value);
+        else if (0 == strcmp(name, ":authority"))
+            snprintf(b->authority, sizeof(b->authority), "%s", value);
+        return;
+    }
+    /* HTTP/2 不使用 transfer-encoding，需要 chunked 时由 h2_on_header_block() 自己添加。*/
+    if (is_hop_by_hop(name) || (0 == strcmp(name, "host")) || (0 == strcmp(name, "transfer-encoding")) ||
+        strpbrk(value, "\r\n"))
+        return;
+    if (0 == strcmp(name, "cookie"))
+    {   /* HTTP/2 允许把 Cookie 拆成多个 Header，转换回 HTTP/1.1 时重新合并。*/
+        size_t len = strlen(b->cookie);
+        snprintf(b->cookie + len, sizeof(b->cookie) - len, "%s%s", len ? "; " : "", value);
+        return;
+    }
+    if (0 == strcmp(name, "content-length"))
+        b->content_len = atoll(value);
+
+    int n = snprintf(b->headers + b->headers_len, sizeof(b->headers) - b->headers_len, "%s: %s\r\n", name, value);
+    if ((n < 0) || ((size_t)n >= sizeof(b->headers) - b->headers_len))
+        b->error = 1;
+    else
+        b->headers_len += n;
+}
+
+/* Client 发送了完整的缓冲 Body（END_STREAM），补上 Content-Length 后启动处理线程。*/
+static void h2_start_buffered_stream(struct h2_conn *c, struct h2_stream *s)
+{
+    char *head = realloc(s->req_head, s->req_head_len + 64);
+
+    if (NULL == head)
+    {
+        h2_rst_stream(c, s->id, H2_INTERNAL_ERROR);
+        h2_close_stream(s);
+        return;
+    }
+    s->req_head = head;
+    s->req_head_len += snprintf(s->req_head + s->req_head_len, 64, "Content-Length: %zu\r\n\r\n", s->body_len);
+    if (FAIL == h2_start_stream(c, s))
+    {
+        h2_rst_stream(c, s->id, H2_INTERNAL_ERROR);
+        h2_close_stream(s);
+    }
+}
+
+/**********************************************************************/
+/* 处理一个完整的 Header Block：新建 Stream，或者是已有 Stream 的 Trailers。
+ * Returns：
+ *   - SUCCESS，连接级错误返回 FAIL。
+ **********************************************************************/
+static int h2_on_header_block(struct h2_conn *c)
+{
+    struct h2_request_builder *b = calloc(1, sizeof(*b));
+    uint32_t id = c->hblock_stream;
+    int i;
+
+    if (NULL == b)
+        return FAIL;
+    b->content_len = -1;
+    if (FAIL == hpack_decode(&c->dec, c->hblock, c->hblock_len, h2_collect_header, b))
+    {
+        free(b);
+        h2_goaway(c, H2_COMPRESSION_ERROR);
+        return FAIL;
+    }
+
+    /* 已有 Stream 上的 HEADERS 是 Trailers，忽略其内容，只处理 END_STREAM。*/
+    struct h2_stream *s = h2_find_stream(c, id);
+    if (NULL != s)
+    {
+        free(b);
+        if (!c->hblock_end_stream)
+            return SUCCESS;
+        s->remote_closed = 1;
+        if (!s->started)
+            h2_start_buffered_stream(c, s);
+        else if (FAIL == h2_stream_write(c, s))
+        {
+            h2_rst_stream(c, s->id, H2_INTERNAL_ERROR);
+            h2_close_stream(s);
+        }
+        return SUCCESS;
+    }
+
+    if ((0 == (id & 1)) || (id <= c->last_stream_id))
+    {
+        free(b);
+        h2_goaway(c, H2_PROTOCOL_ERROR);
+        return FAIL;
+    }
+    c->last_stream_id = id;
+
+    if (c->goaway || b->error || ('\0' == b->method[0]) || ('/' != b->path[0]))
+    {
+        free(b);
+        h2_rst_stream(c, id, c->goaway ? H2_REFUSED_STREAM : H2_PROTOCOL_ERROR);
+        return SUCCESS;
+    }
+    for (i = 0; (i < H2_MAX_STREAMS) && c->streams[i].in_use; i++)
+        ;
+    if (i == H2_MAX_STREAMS)
+    {
+        free(b);
+        h2_rst_stream(c, id, H2_REFUSED_STREAM);
+        return SUCCESS;
+    }
+
+    s = &c->streams[i];
+    memset(s, 0, sizeof(*s));
+    s->in_use = 1;
+    s->id = id;
+    s->fd = -1;
+    s->send_window = c->peer_initial_window;
+    s->remote_closed = c->hblock_end_stream;
+
+    size_t cap = 1024 + strlen(b->path) + b->headers_len + strlen(b->cookie) + strlen(b->authority);
+    if (NULL == (s->req_head = malloc(cap)))
+    {
+        h2_close_stream(s);
+        h2_rst_stream(c, id, H2_INTERNAL_ERROR);
+        free(b);
+        return SUCCESS;
+    }
+    s->req_head_len = snprintf(s->req_head, cap, "%s %s HTTP/1.1\r\nHost: %s\r\n%s%s%s%s",
+                               b->method, b->path, b->authority, b->headers,
+                               b->cookie[0] ? "Cookie: " : "", b->cookie, b->cookie[0] ? "\r\n" : "");
+
+    /* 长度已知（有 content-length 或者没有 Body）时立即启动，否则等 END_STREAM 再补上 Content-Length。
+     * 上传的大小可能远超 H2_MAX_BUFFERED_BODY，改为 chunked 编码边收边写，同样立即启动。*/
+    s->in_chunked = (b->content_len < 0) && !s->remote_closed &&
+                    ((0 == strcmp(b->method, "PUT")) || ((0 == strcmp(b->method, "POST")) && is_upload_url(b->path)));
+    if ((b->content_len >= 0) || s->remote_closed || s->in_chunked)
+    {
+        s->req_head_len += snprintf(s->req_head + s->req_head_len, cap - s->req_head_len, "%s\r\n",
+                                    s->in_chunked ? "Transfer-Encoding: chunked\r\n" : "");
+        if (FAIL == h2_start_stream(c, s))
+        {
+            h2_close_stream(s);
+            h2_rst_stream(c, id, H2_INTERNAL_ERROR);
+        }
+    }
+    free(b);
+
+    return SUCCESS;
+}
+
+/**********************************************************************/
+/* 把 Stream 缓冲的 Request Body 非阻塞地写入 socketpair。
+ * 只有处理线程实际读走的字节才归还 Stream 的流量控制窗口：处理线程不读取 Body
+ * （e.g. 先写 Response 的 CGI）时数据留在缓冲区，Client 因窗口耗尽而暂停，
+ * 连接线程不会被阻塞，其它 Stream 照常收发。缓冲区写空且收到 END_STREAM 后关闭写端。
+ * Returns：
+ *   - SUCCESS，socketpair 出错返回 FAIL。
+ **********************************************************************/
+static int h2_stream_write(struct h2_conn *c, struct h2_stream *s)
+{
+    size_t off = 0;
+
+    for ( ;; )
+    {
+        const char *data;
+        size_t len;
+        int framing = (s->in_frame_off < s->in_frame_len);
+
+        if (framing)
+        {
+            data = s->in_frame + s->in_frame_off;
+            len = s->in_frame_len - s->in_frame_off;
+        }
+        else if (off < s->in_len)
+        {
+            /* chunked：把当前缓冲的数据作为一个 chunk，先写 chunk-size。*/
+            if (s->in_chunked && (0 == s->in_chunk_left))
+            {
+                s->in_chunk_left = s->in_len - off;
+                s->in_frame_len = sprintf(s->in_frame, "%zx\r\n", s->in_chunk_left);
+                s->in_frame_off = 0;
+                continue;
+            }
+            data = s->in + off;
+            len = s->in_len - off;
+            if (s->in_chunked && (len > s->in_chunk_left))
+                len = s->in_chunk_left;
+        }
+        else if (s->in_chunked && s->remote_closed && !s->in_last_chunk)
+        {
+            s->in_frame_len = sprintf(s->in_frame, "0\r\n\r\n");
+            s->in_frame_off = 0;
+            s->in_last_chunk = 1;
+            continue;
+        }
+        else
+            break;
+
+        ssize_t n = send(s->fd, data, len, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                break;
+            if ((errno != EPIPE) && (errno != ECONNRESET))
+                return FAIL;
+            /* 处理线程不读取剩余的 Body 就结束了：丢弃数据，已经写出的 Response 照常返回。*/
+            off = s->in_len;
+            s->in_frame_off = s->in_frame_len;
+            s->in_chunk_left = 0;
+            s->in_last_chunk = 1;
+            break;
+        }
+        if (framing)
+        {
+            s->in_frame_off += n;
+            continue;
+        }
+        off += n;  // 只有 Body 数据计入流量控制窗口，chunk 分隔不计。
+        if (s->in_chunked && (0 == (s->in_chunk_left -= n)))
+        {
+            s->in_frame_len = sprintf(s->in_frame, "\r\n");
+            s->in_frame_off = 0;
+        }
+    }
+    if (off > 0)
+    {
+        s->in_len -= off;
+        memmove(s->in, s->in + off, s->in_len);
+        if (!s->remote_closed)
+            h2_window_update(c, s->id, off);
+    }
+
+    if (s->remote_closed && (0 == s->in_len) && (s->in_frame_off == s->in_frame_len) &&
+        (!s->in_chunked || s->in_last_chunk))
+        shutdown(s->fd, SHUT_WR);
+    return SUCCESS;
+}
+
+/* 处理 DATA 帧：转发给处理线程。连接窗口立即归还，每个 Stream 最多缓冲一个 Stream 窗口，
+ * 总量受 H2_MAX_STREAMS * H2_INITIAL_WINDOW 限制，一个停滞的 Stream 不会占满连接窗口。*/
+static int h2_on_data(struct h2_conn *c, struct h2_stream *s, int flags,
+                      const unsigned char *data, size_t len, size_t frame_len)
+{
+    if (frame_len > 0)
+        h2_window_update(c, 0, frame_len);
+    if ((NULL == s) || s->remote_closed)
+        return SUCCESS;  // 已经结束（或被拒绝）的 Stream，Client 可能还在发送剩余的数据。
+
+    if (s->started)
+    {
+        /* Client 遵守流量控制时，未归还窗口的数据不会超过 H2_INITIAL_WINDOW。*/
+        if (s->in_len + len > H2_INITIAL_WINDOW)
+        {
+            h2_rst_stream(c, s->id, H2_FLOW_CONTROL_ERROR);
+            h2_close_stream(s);
+            return SUCCESS;
+        }
+        if ((NULL == s->in) && (NULL == (s->in = malloc(H2_INITIAL_WINDOW))))
+        {
+            h2_rst_stream(c, s->id, H2_INTERNAL_ERROR);
+            h2_close_stream(s);
+            return SUCCESS;
+        }
+        memcpy(s->in + s->in_len, data, len);
+        s->in_len += len;
+
+        /* Padding 不会写入处理线程，立即归还。*/
+        if ((frame_len > len) && !(flags & H2_FLAG_END_STREAM))
+            h2_window_update(c, s->id, frame_len - len);
+        if (flags & H2_FLAG_END_STREAM)
+            s->remote_closed = 1;
+        if (FAIL == h2_stream_write(c, s))
+        {
+            h2_rst_stream(c, s->id, H2_INTERNAL_ERROR);
+            h2_close_stream(s);
+        }
+        return SUCCESS;
+    }
+
+    /* 处理线程尚未启动：Body 缓冲到 END_STREAM，大小受 H2_MAX_BUFFERED_BODY 限制，
+     * 必须立即归还窗口，否则超过一个窗口的 Body 永远等不到 END_STREAM。*/
+    if (len > 0)
+    {
+        char *body = (s->body_len + len <= H2_MAX_BUFFERED_BODY) ? realloc(s->body, s->body_len + len) : NULL;
+        if (NULL == body)
+        {
+            h2_rst_stream(c, s->id, H2_REFUSED_STREAM);
+            h2_close_stream(s);
+            return SUCCESS;
+        }
+        s->body = body;
+        memcpy(s->body + s->body_len, data, len);
+        s->body_len += len;
     }
-    else
+    if ((frame_len > 0) && !(flags & H2_FLAG_END_STREAM))
+        h2_window_update(c, s->id, frame_len);
+
+    if (flags & H2_FLAG_END_STREAM)
     {
-        // 响应 Header
-        send_headers(cli_socket_fd, filename);
-        // 响应 File Content
-        send_contents(cli_socket_fd, resource);
+        s->remote_closed = 1;
+        h2_start_buffered_stream(c, s);
+    }
+
+    return SUCCESS;
+}
+
+/* 应用 SETTINGS 参数（来自 SETTINGS 帧或者 HTTP2-Settings Header）。*/
+static int h2_apply_settings(struct h2_conn *c, const unsigned char *p, size_t len)
+{
+    size_t off;
+    int i;
+
+    if (len % 6)
+    {
+        h2_goaway(c, H2_FRAME_SIZE_ERROR);
+        return FAIL;
+    }
+    for (off = 0; off < len; off += 6)
+    {
+        int id = (p[off] << 8) | p[off + 1];
+        uint32_t value = h2_get32(p + off + 2);
+
+        switch (id)
+        {
+        case H2_SETTINGS_HEADER_TABLE_SIZE:
+            /* 编码器使用的动态表不能超过 Client 允许的大小。*/
+            hpack_table_resize(&c->enc, (value < H2_HEADER_TABLE_SIZE) ? value : H2_HEADER_TABLE_SIZE);
+            c->enc_size_update = 1;
+            break;
+        case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+            if (value > H2_MAX_WINDOW)
+            {
+                h2_goaway(c, H2_FLOW_CONTROL_ERROR);
+                return FAIL;
+            }
+            for (i = 0; i < H2_MAX_STREAMS; i++)
+            {
+                if (c->streams[i].in_use)
+                    c->streams[i].send_window += (long long)value - c->peer_initial_window;
+            }
+            c->peer_initial_window = value;
+            break;
+        case H2_SETTINGS_MAX_FRAME_SIZE:
+            if ((value < 16384) || (value > 16777215))
+            {
+                h2_goaway(c, H2_PROTOCOL_ERROR);
+                return FAIL;
+            }
+            break;  // 本端发送的帧不超过 16384，总是满足 Client 的限制。
+        default:
+            break;
+        }
+    }
+
+    return SUCCESS;
+}
+
+/**********************************************************************/
+/* 处理一个完整的帧。
+ * Returns：
+ *   - SUCCESS，连接级错误（已发送 GOAWAY）返回 FAIL。
+ **********************************************************************/
+static int h2_on_frame(struct h2_conn *c, int type, int flags, uint32_t stream_id,
+                       const unsigned char *p, size_t len)
+{
+    size_t frame_len = len;
+    size_t pad = 0;
+
+    /* 正在接收 Header Block 时，只能收到同一 Stream 的 CONTINUATION。*/
+    if ((0 != c->hblock_stream) && ((H2_CONTINUATION != type) || (stream_id != c->hblock_stream)))
+    {
+        h2_goaway(c, H2_PROTOCOL_ERROR);
+        return FAIL;
+    }
+
+    switch (type)
+    {
+    case H2_DATA:
+    case H2_HEADERS:
+        if (0 == stream_id)
+        {
+            h2_goaway(c, H2_PROTOCOL_ERROR);
+            return FAIL;
+        }
+        if (flags & H2_FLAG_PADDED)
+        {
+            if ((len < 1) || ((pad = p[0]) >= len))
+            {
+                h2_goaway(c, H2_PROTOCOL_ERROR);
+                return FAIL;
+            }
+            p++;
+            len -= 1 + pad;
+        }
+        if (H2_DATA == type)
+            return h2_on_data(c, h2_find_stream(c, stream_id), flags, p, len, frame_len);
+
+        if (flags & H2_FLAG_PRIORITY)
+        {
+            if (len < 5)
+            {
+                h2_goaway(c, H2_PROTOCOL_ERROR);
+                return FAIL;
+            }
+            p += 5;
+            len -= 5;
+        }
+        c->hblock_stream = stream_id;
+        c->hblock_end_stream = flags & H2_FLAG_END_STREAM;
+        c->hblock_len = 0;
+        /* HEADERS 中的 Header Block 片段与 CONTINUATION 的处理相同。*/
+        /* fall through */
+    case H2_CONTINUATION:
+        if ((0 == c->hblock_stream) || (c->hblock_len + len > sizeof(c->hblock)))
+        {
+            h2_goaway(c, (0 == c->hblock_stream) ? H2_PROTOCOL_ERROR : H2_COMPRESSION_ERROR);
+            return FAIL;
+        }
+        memcpy(c->hblock + c->hblock_len, p, len);
+        c->hblock_len += len;
+        if (flags & H2_FLAG_END_HEADERS)
+        {
+            int rc = h2_on_header_block(c);
+            c->hblock_stream = 0;
+            return rc;
+        }
+        return SUCCESS;
+
+    case H2_SETTINGS:
+        if (0 != stream_id)
+        {
+            h2_goaway(c, H2_PROTOCOL_ERROR);
+            return FAIL;
+        }
+        if (flags & H2_FLAG_ACK)
+            return SUCCESS;
+        if (FAIL == h2_apply_settings(c, p, len))
+            return FAIL;
+        return h2_send_frame(c, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+
+    case H2_PING:
+        if ((0 != stream_id) || (8 != len))
+        {
+            h2_goaway(c, (8 != len) ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+            return FAIL;
+        }
+        if (flags & H2_FLAG_ACK)
+            return SUCCESS;
+        return h2_send_frame(c, H2_PING, H2_FLAG_ACK, 0, p, len);
+
+    case H2_WINDOW_UPDATE:
+    {
+        if (4 != len)
+        {
+            h2_goaway(c, H2_FRAME_SIZE_ERROR);
+            return FAIL;
+        }
+        uint32_t increment = h2_get32(p) & 0x7fffffff;
+        if (0 == stream_id)
+        {
+            if ((0 == increment) || (c->send_window + increment > H2_MAX_WINDOW))
+            {
+                h2_goaway(c, (0 == increment) ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+                return FAIL;
+            }
+            c->send_window += increment;
+            return SUCCESS;
+        }
+        struct h2_stream *s = h2_find_stream(c, stream_id);
+        if (NULL == s)
+            return SUCCESS;
+        if ((0 == increment) || (s->send_window + increment > H2_MAX_WINDOW))
+        {
+            h2_rst_stream(c, stream_id, (0 == increment) ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+            h2_close_stream(s);
+            return SUCCESS;
+        }
+        s->send_window += increment;
+        return SUCCESS;
+    }
+
+    case H2_RST_STREAM:
+    {
+        struct h2_stream *s = h2_find_stream(c, stream_id);
+        if ((0 == stream_id) || (4 != len))
+        {
+            h2_goaway(c, (4 != len) ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+            return FAIL;
+        }
+        if (NULL != s)
+            h2_close_stream(s);
+        return SUCCESS;
+    }
+
+    case H2_GOAWAY:
+        c->goaway = 1;  // 不再接受新的 Stream，处理完已有 Stream 后关闭连接。
+        return SUCCESS;
+
+    case H2_PUSH_PROMISE:
+        h2_goaway(c, H2_PROTOCOL_ERROR);
+        return FAIL;
+
+    default:
+        return SUCCESS;  // PRIORITY 和未知类型的帧直接忽略。
+    }
+}
+
+/* 发送 Header Block，超过一个帧的部分使用 CONTINUATION 帧。*/
+static int h2_send_headers(struct h2_conn *c, uint32_t stream_id, const unsigned char *block, size_t len)
+{
+    size_t n = (len > H2_FRAME_SIZE) ? H2_FRAME_SIZE : len;
+    int type = H2_HEADERS;
+
+    for ( ;; )
+    {
+        if (SUCCESS != h2_send_frame(c, type, (n == len) ? H2_FLAG_END_HEADERS : 0, stream_id, block, n))
+            return FAIL;
+        block += n;
+        len -= n;
+        if (0 == len)
+            return SUCCESS;
+        n = (len > H2_FRAME_SIZE) ? H2_FRAME_SIZE : len;
+        type = H2_CONTINUATION;
+    }
+}
+
+/* Response Body 输入：按需解码 chunked，结果追加到 pending。*/
+static void h2_body_input(struct h2_stream *s, const char *p, size_t len)
+{
+    while (len > 0)
+    {
+        if (!s->chunked)
+        {
+            memcpy(s->pending + s->pending_len, p, len);
+            s->pending_len += len;
+            return;
+        }
+
+        if (H2_CHUNK_DATA == s->chunk_state)
+        {
+            size_t n = ((long long)len < s->chunk_left) ? len : (size_t)s->chunk_left;
+            memcpy(s->pending + s->pending_len, p, n);
+            s->pending_len += n;
+            s->chunk_left -= n;
+            p += n;
+            len -= n;
+            if (0 == s->chunk_left)
+                s->chunk_state = H2_CHUNK_CRLF;
+            continue;
+        }
+
+        /* 其余状态都是按行处理：chunk size、chunk 后的 CRLF、trailer。*/
+        char ch = *p++;
+        len--;
+        if ('\n' != ch)
+        {
+            if (('\r' != ch) && (s->chunk_line_len < sizeof(s->chunk_line) - 1))
+                s->chunk_line[s->chunk_line_len++] = ch;
+            continue;
+        }
+        s->chunk_line[s->chunk_line_len] = '\0';
+        if (H2_CHUNK_SIZE == s->chunk_state)
+        {
+            s->chunk_left = strtoll(s->chunk_line, NULL, 16);
+            s->chunk_state = (s->chunk_left > 0) ? H2_CHUNK_DATA : H2_CHUNK_TRAILER;
+        }
+        else if (H2_CHUNK_CRLF == s->chunk_state)
+        {
+            s->chunk_state = H2_CHUNK_SIZE;
+        }
+        else if ((H2_CHUNK_TRAILER == s->chunk_state) && (0 == s->chunk_line_len))
+        {
+            s->chunk_state = H2_CHUNK_DONE;
+        }
+        s->chunk_line_len = 0;
+    }
+}
+
+/**********************************************************************/
+/* 把处理线程返回的 HTTP/1.x Response Header 转换成 HEADERS 帧：
+ *   - Status Line（以及 CGI 的 Status: Header）转换为 :status；
+ *   - Header 名称转为小写，去掉 hop-by-hop Header；
+ *   - Transfer-Encoding: chunked 的 Body 在转发时解码。
+ * Returns：
+ *   - SUCCESS，Client 连接出错返回 FAIL。
+ **********************************************************************/
+static int h2_response_head(struct h2_conn *c, struct h2_stream *s, char *head)
+{
+    unsigned char *block = malloc(H2_MAX_HEADER_BLOCK);
+    char status[4] = "200";
+    char *line, *save = NULL;
+    size_t n = 0, rc;
+    int first = 1;
+
+    if (NULL == block)
+        return FAIL;
+
+    /* 先收集 Header，:status 必须位于 Header Block 的最前面。*/
+    char *names[64], *values[64];
+    int count = 0, i;
+
+    for (line = strtok_r(head, "\n", &save); NULL != line; line = strtok_r(NULL, "\n", &save))
+    {
+        size_t len = strlen(line);
+        if ((len > 0) && ('\r' == line[len - 1]))
+            line[--len] = '\0';
+
+        if (first && (0 == strncmp(line, "HTTP/", 5)))
+        {
+            char *sp = strchr(line, ' ');
+            if ((NULL != sp) && isdigit((unsigned char)sp[1]))
+                snprintf(status, sizeof(status), "%.3s", sp + 1);
+            first = 0;
+            continue;
+        }
+        first = 0;
+
+        char *colon = strchr(line, ':');
+        if ((NULL == colon) || (count >= 64))
+            continue;
+        *colon = '\0';
+        char *value = colon + 1;
+        while (IS_SPACE(*value))
+            value++;
+        char *p;
+        for (p = line; *p; p++)
+            *p = tolower((unsigned char)*p);
+
+        if (0 == strcmp(line, "status"))
+        {   /* CGI 的 Status: 404 Not Found */
+            if (isdigit((unsigned char)value[0]))
+                snprintf(status, sizeof(status), "%.3s", value);
+            continue;
+        }
+        if (0 == strcmp(line, "transfer-encoding"))
+        {
+            s->chunked = (NULL != strcasestr(value, "chunked"));
+            continue;
+        }
+        if (is_hop_by_hop(line))
+            continue;
+        names[count] = line;
+        values[count] = value;
+        count++;
+    }
+
+    /* 对端缩小了 HEADER_TABLE_SIZE，在下一个 Header Block 开头通知动态表大小的变化。*/
+    if (c->enc_size_update)
+    {
+        n += hpack_encode_int(block + n, c->enc.max_size, 5, 0x20);
+        c->enc_size_update = 0;
+    }
+    n += hpack_encode_header(&c->enc, block + n, H2_MAX_HEADER_BLOCK - n, ":status", status, 1);
+    for (i = 0; i < count; i++)
+    {
+        /* content-length 每次都不一样，加入动态表只会挤掉有用的条目。*/
+        rc = hpack_encode_header(&c->enc, block + n, H2_MAX_HEADER_BLOCK - n, names[i], values[i],
+                                 strcmp(names[i], "content-length") && strcmp(names[i], "date"));
+        if (0 == rc)
+            break;
+        n += rc;
+    }
+
+    int ret = h2_send_headers(c, s->id, block, n);
+    free(block);
+    return ret;
+}
+
+/**********************************************************************/
+/* 读取处理线程的 Response。
+ * Returns：
+ *   - SUCCESS，Client 连接出错返回 FAIL。
+ **********************************************************************/
+static int h2_stream_read(struct h2_conn *c, struct h2_stream *s)
+{
+    char buf[8192];
+    size_t room = s->head_done ? sizeof(s->pending) - s->pending_len : sizeof(s->resp_head) - 1 - s->resp_head_len;
+    ssize_t n = recv(s->fd, s->head_done ? buf : s->resp_head + s->resp_head_len, room, 0);
+
+    if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+        return SUCCESS;
+    if (n <= 0)
+    {
+        s->resp_eof = 1;
+        if (!s->head_done)
+        {   /* 处理线程没有返回完整的 Response Header。*/
+            h2_rst_stream(c, s->id, H2_INTERNAL_ERROR);
+            h2_close_stream(s);
+        }
+        return SUCCESS;
+    }
+
+    if (s->head_done)
+    {
+        h2_body_input(s, buf, n);
+        return SUCCESS;
+    }
+
+    /* Header 与 Body 之间的空行，兼容 CGI 只使用 \n 的输出。*/
+    s->resp_head_len += n;
+    s->resp_head[s->resp_head_len] = '\0';
+    char *end = strstr(s->resp_head, "\n\r\n");
+    size_t skip = 3;
+    char *end_lf = strstr(s->resp_head, "\n\n");
+    if ((NULL == end) || ((NULL != end_lf) && (end_lf < end)))
+    {
+        end = end_lf;
+        skip = 2;
+    }
+    if (NULL == end)
+    {
+        if (s->resp_head_len == sizeof(s->resp_head) - 1)
+        {
+            h2_rst_stream(c, s->id, H2_INTERNAL_ERROR);
+            h2_close_stream(s);
+        }
+        return SUCCESS;
+    }
+
+    char *body = end + skip;
+    size_t body_len = s->resp_head + s->resp_head_len - body;
+    end[1] = '\0';
+    s->head_done = 1;
+    if (SUCCESS != h2_response_head(c, s, s->resp_head))
+        return FAIL;
+    h2_body_input(s, body, body_len);
+
+    return SUCCESS;
+}
+
+/**********************************************************************/
+/* 在流量控制窗口内把 pending 中的 Body 发送给 Client，Response 结束时关闭 Stream。
+ * Returns：
+ *   - SUCCESS，Client 连接出错返回 FAIL。
+ **********************************************************************/
+static int h2_stream_flush(struct h2_conn *c, struct h2_stream *s)
+{
+    while (s->pending_len > 0)
+    {
+        long long window = (c->send_window < s->send_window) ? c->send_window : s->send_window;
+        size_t n = s->pending_len;
+
+        if (window <= 0)
+            return SUCCESS;
+        if ((long long)n > window)
+            n = window;
+        if (n > H2_FRAME_SIZE)
+            n = H2_FRAME_SIZE;
+
+        int end = s->resp_eof && (n == s->pending_len);
+        if (SUCCESS != h2_send_frame(c, H2_DATA, end ? H2_FLAG_END_STREAM : 0, s->id, s->pending, n))
+            return FAIL;
+        c->send_window -= n;
+        s->send_window -= n;
+        s->pending_len -= n;
+        memmove(s->pending, s->pending + n, s->pending_len);
+        if (end)
+            goto done;
+    }
+
+    if (!s->resp_eof)
+        return SUCCESS;
+    if (SUCCESS != h2_send_frame(c, H2_DATA, H2_FLAG_END_STREAM, s->id, NULL, 0))
+        return FAIL;
+
+done:
+    /* Response 已经完整发送，Client 还没有发送完的 Body 不再需要。*/
+    if (!s->remote_closed)
+        h2_rst_stream(c, s->id, H2_NO_ERROR);
+    h2_close_stream(s);
+    return SUCCESS;
+}
+
+/* 解码 HTTP2-Settings Header（base64url，没有填充）。Returns：解码后的字节数，出错返回 -1。*/
+static ssize_t h2_base64url_decode(const char *in, unsigned char *out, size_t size)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t n = 0;
+
+    for ( ; *in && ('=' != *in); in++)
+    {
+        const char *pos = strchr(alphabet, *in);
+        if (NULL == pos)
+            return -1;
+        acc = (acc << 6) | (pos - alphabet);
+        bits += 6;
+        if (bits >= 8)
+        {
+            bits -= 8;
+            if (n >= size)
+                return -1;
+            out[n++] = (acc >> bits) & 0xff;
+        }
+    }
+
+    return n;
+}
+
+/* h2c Upgrade：原 HTTP/1.1 Request 成为 Stream 1，它已经没有 Body。*/
+static int h2_upgrade_stream(struct h2_conn *c, const struct http_request *req)
+{
+    struct h2_stream *s = &c->streams[0];
+    size_t cap = 1024 + req->num_headers * (sizeof(req->headers[0]) + 4);
+    int i;
+
+    memset(s, 0, sizeof(*s));
+    s->in_use = 1;
+    s->id = 1;
+    s->fd = -1;
+    s->send_window = c->peer_initial_window;
+    s->remote_closed = 1;
+    c->last_stream_id = 1;
+
+    if (NULL == (s->req_head = malloc(cap)))
+        return FAIL;
+    s->req_head_len = snprintf(s->req_head, cap, "%s %s HTTP/1.1\r\n", req->method, req->url);
+    for (i = 0; i < req->num_headers; i++)
+    {
+        const struct http_header *hdr = &req->headers[i];
+        if (is_hop_by_hop(hdr->name) || (0 == strcasecmp(hdr->name, "HTTP2-Settings")))
+            continue;
+        s->req_head_len += snprintf(s->req_head + s->req_head_len, cap - s->req_head_len,
+                                    "%s: %s\r\n", hdr->name, hdr->value);
+    }
+    s->req_head_len += snprintf(s->req_head + s->req_head_len, cap - s->req_head_len, "\r\n");
+
+    return h2_start_stream(c, s);
+}
+
+/**********************************************************************/
+/* HTTP/2 连接的主循环，在连接的处理线程中运行。
+ * 同时等待 Client Socket 和所有 Stream 的 socketpair：
+ *   - Client 的帧在这里解析，Request 转交给各自的处理线程；
+ *   - 处理线程的 Response 在流量控制窗口内转换成 HEADERS/DATA 帧。
+ * Parameters：
+ *   - Client Socket fd；
+ *   - upgrade：h2c Upgrade 的原始 Request，prior knowledge 时为 NULL
+ *     （此时 Client Preface 的第一行已经被 request_handle() 读取）。
+ **********************************************************************/
+void h2_serve(intptr_t cli_socket_fd, const struct http_request *upgrade)
+{
+    struct h2_conn *c = calloc(1, sizeof(*c));
+    struct pollfd pfds[1 + H2_MAX_STREAMS];
+    struct h2_stream *pstreams[1 + H2_MAX_STREAMS];
+    int i;
+
+    if (NULL == c)
+        return;
+    c->fd = cli_socket_fd;
+    c->send_window = H2_INITIAL_WINDOW;
+    c->peer_initial_window = H2_INITIAL_WINDOW;
+    hpack_table_init(&c->dec, H2_HEADER_TABLE_SIZE);
+    hpack_table_init(&c->enc, H2_HEADER_TABLE_SIZE);
+    for (i = 0; i < H2_MAX_STREAMS; i++)
+        c->streams[i].fd = -1;
+
+    /* Server Preface：本端的 SETTINGS。*/
+    unsigned char settings[6];
+    settings[0] = 0;
+    settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    h2_put32(settings + 2, H2_MAX_STREAMS);
+    if (SUCCESS != h2_send_frame(c, H2_SETTINGS, 0, 0, settings, sizeof(settings)))
+        goto out;
+
+    if (NULL != upgrade)
+    {
+        unsigned char peer[256];
+        const char *hdr = get_header(upgrade, "HTTP2-Settings");
+        ssize_t len = h2_base64url_decode(hdr ? hdr : "", peer, sizeof(peer));
+        if ((len < 0) || (FAIL == h2_apply_settings(c, peer, len)))
+            goto out;
+        c->need_preface = 1;
+        if (FAIL == h2_upgrade_stream(c, upgrade))
+        {
+            h2_rst_stream(c, 1, H2_INTERNAL_ERROR);
+            h2_close_stream(&c->streams[0]);
+        }
+    }
+
+    for ( ;; )
+    {
+        int nfds = 1;
+        int active = h2_active_streams(c);
+
+        if (c->goaway && (0 == active))
+            break;
+
+        pfds[0].fd = c->fd;
+        pfds[0].events = POLLIN;
+        for (i = 0; i < H2_MAX_STREAMS; i++)
+        {
+            struct h2_stream *s = &c->streams[i];
+            short events = 0;
+            if (!s->in_use || !s->started)
+                continue;
+            /* pending 没有发送完（等待 WINDOW_UPDATE）时不再读取，由 socketpair 对处理线程形成背压。*/
+            if (!s->resp_eof && (0 == s->pending_len))
+                events |= POLLIN;
+            /* 缓冲的 Request Body 等待处理线程读取。*/
+            if (s->in_len > 0)
+                events |= POLLOUT;
+            if (events)
+            {
+                pfds[nfds].fd = s->fd;
+                pfds[nfds].events = events;
+                pstreams[nfds] = s;
+                nfds++;
+            }
+        }
+
+        /* OpenSSL 中已经解密的数据不会触发 poll()，此时不等待，直接读取。*/
+        int pending = conn_pending(c->fd);
+        int rc = poll(pfds, nfds, pending ? 0 : H2_IDLE_TIMEOUT_MS);
+        if ((rc < 0) && (errno == EINTR))
+            continue;
+        if (pending)
+            pfds[0].revents |= POLLIN;
+        else if (rc <= 0)
+        {
+            h2_goaway(c, H2_NO_ERROR);
+            break;
+        }
+
+        /* 处理线程读取了 Request Body，或者返回了 Response。*/
+        for (i = 1; i < nfds; i++)
+        {
+            struct h2_stream *s = pstreams[i];
+            if (0 == pfds[i].revents)
+                continue;
+            if ((pfds[i].events & POLLOUT) && (FAIL == h2_stream_write(c, s)))
+            {
+                h2_rst_stream(c, s->id, H2_INTERNAL_ERROR);
+                h2_close_stream(s);
+                continue;
+            }
+            if ((pfds[i].events & POLLIN) && s->in_use && (SUCCESS != h2_stream_read(c, s)))
+                goto out;
+        }
+
+        /* Client 的帧。*/
+        if (pfds[0].revents)
+        {
+            ssize_t n = conn_recv(c->fd, c->rbuf + c->rbuf_len, sizeof(c->rbuf) - c->rbuf_len, 0);
+            if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+                n = -2;
+            if ((0 == n) || (-1 == n))
+                break;
+            if (n > 0)
+                c->rbuf_len += n;
+
+            if (c->need_preface && (c->rbuf_len >= H2_PREFACE_LEN))
+            {
+                if (memcmp(c->rbuf, H2_PREFACE, H2_PREFACE_LEN))
+                    break;
+                c->rbuf_len -= H2_PREFACE_LEN;
+                memmove(c->rbuf, c->rbuf + H2_PREFACE_LEN, c->rbuf_len);
+                c->need_preface = 0;
+            }
+            while (!c->need_preface && (c->rbuf_len >= 9))
+            {
+                size_t len = ((size_t)c->rbuf[0] << 16) | (c->rbuf[1] << 8) | c->rbuf[2];
+                if (len > H2_FRAME_SIZE)
+                {
+                    h2_goaway(c, H2_FRAME_SIZE_ERROR);
+                    goto out;
+                }
+                if (c->rbuf_len < 9 + len)
+                    break;
+                if (SUCCESS != h2_on_frame(c, c->rbuf[3], c->rbuf[4], h2_get32(c->rbuf + 5) & 0x7fffffff,
+                                           c->rbuf + 9, len))
+                    goto out;
+                c->rbuf_len -= 9 + len;
+                memmove(c->rbuf, c->rbuf + 9 + len, c->rbuf_len);
+            }
+        }
+
+        /* WINDOW_UPDATE 或者新的 Response 数据都可能让 Stream 继续发送。*/
+        for (i = 0; i < H2_MAX_STREAMS; i++)
+        {
+            if (c->streams[i].in_use && c->streams[i].head_done &&
+                (SUCCESS != h2_stream_flush(c, &c->streams[i])))
+                goto out;
+        }
+    }
+
+out:
+    for (i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        if (c->streams[i].in_use)
+            h2_close_stream(&c->streams[i]);
     }
+    hpack_table_free(&c->dec);
+    hpack_table_free(&c->enc);
+    free(c);
+}
+
+
+
+/*************************
+ * TLS
+ *************************/
+
+#ifdef ENABLE_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+/* HTTPS 规格参数。证书和私钥为 PEM 格式。*/
+#define TLS_PORT                8443
+#define TLS_CERT_FILE           "tls/server.crt"
+#define TLS_KEY_FILE            "tls/server.key"
+#define TLS_SESSION_CACHE_SIZE  20480       // 服务端 Session 缓存条目数（Session ID 复用）。
+#define TLS_SESSION_TIMEOUT     3600        // Session 和 Ticket 的有效期（秒）。
+#define TLS_NUM_TICKETS         1           // TLS 1.3 握手后发送的 Session Ticket 数量。
 
-    fclose(resource);
+static SSL_CTX *tls_ctx;
+
+void request_handle(void *arg);
+
+/* 运行时指标，原子更新。*/
+static unsigned long tls_handshakes;
+static unsigned long tls_resumed;
+static unsigned long tls_ktls;          // 收发两个方向都由内核 kTLS 处理的连接。
+static unsigned long tls_ktls_tx;       // 只有发送方向由 kTLS 处理、接收方向由 OpenSSL 解密的连接。
+static unsigned long tls_userspace;     // 退回用户态 TLS（socketpair 桥接）的连接。
+static unsigned long tls_failures;
+
+/* ALPN：Client 支持时选择 h2（由 request_handle() 识别 Client Preface），否则使用 HTTP/1.1。*/
+static int tls_alpn_select(SSL *ssl, const unsigned char **out, unsigned char *out_len,
+                           const unsigned char *in, unsigned int in_len, void *arg)
+{
+    static const unsigned char protos[] = "\x02h2\x08http/1.1";
+    (void)ssl;
+    (void)arg;
+
+    if (OPENSSL_NPN_NEGOTIATED != SSL_select_next_proto((unsigned char **)out, out_len, protos,
+                                                         sizeof(protos) - 1, in, in_len))
+        return SSL_TLSEXT_ERR_NOACK;
+
+    return SSL_TLSEXT_ERR_OK;
 }
 
 /**********************************************************************/
-/* Inform the client that a request it has made has a problem.
- * Parameters: client socket */
-/**********************************************************************/
-void bad_request(intptr_t cli_socket_fd)
+/* 初始化 TLS：加载证书和私钥，开启 kTLS、Session 缓存和 Session Ticket。
+ * Returns：
+ *   - SUCCESS，证书或私钥不可用时返回 FAIL（只提供 HTTP 服务）。
+ **********************************************************************/
+int tls_init(void)
 {
-    char buff[1024];
+    static const unsigned char sid_ctx[] = "tinyhttpd";
 
-    sprintf(buff, "HTTP/1.0 400 BAD REQUEST\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+    tls_ctx = SSL_CTX_new(TLS_server_method());
+    if (NULL == tls_ctx)
+        return FAIL;
 
-    sprintf(buff, "Content-Type: text/html\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+    /* kTLS 只支持 AES-GCM 和 ChaCha20-Poly1305，优先协商这些算法。*/
+    SSL_CTX_set_cipher_list(tls_ctx, "ECDHE+AESGCM:ECDHE+CHACHA20");
+    SSL_CTX_set_ciphersuites(tls_ctx, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256");
+    /* 握手完成后由 OpenSSL 把密钥交给内核（setsockopt(SOL_TLS)），内核不支持时自动保持用户态加密。*/
+    SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS);
 
-    sprintf(buff, "\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+    /* Session 复用：Session ID 缓存和 Session Ticket（Ticket 密钥由 OpenSSL 在启动时随机生成）。*/
+    SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(tls_ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_session_id_context(tls_ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_timeout(tls_ctx, TLS_SESSION_TIMEOUT);
+    SSL_CTX_set_num_tickets(tls_ctx, TLS_NUM_TICKETS);
 
-    sprintf(buff, "<P>Your browser sent a bad request, ");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+    SSL_CTX_set_alpn_select_cb(tls_ctx, tls_alpn_select, NULL);
 
-    sprintf(buff, "such as a POST without a Content-Length.\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+    if ((1 != SSL_CTX_use_certificate_chain_file(tls_ctx, TLS_CERT_FILE)) ||
+        (1 != SSL_CTX_use_PrivateKey_file(tls_ctx, TLS_KEY_FILE, SSL_FILETYPE_PEM)) ||
+        (1 != SSL_CTX_check_private_key(tls_ctx)))
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(tls_ctx);
+        tls_ctx = NULL;
+        return FAIL;
+    }
+
+    return SUCCESS;
 }
 
-/**********************************************************************/
-/* Inform the client that a CGI script could not be executed.
- * Parameter: the client socket descriptor. */
-/**********************************************************************/
-void cannot_execute(intptr_t cli_socket_fd)
+/* 等待非阻塞 SSL 操作需要的 I/O 就绪。Returns：SUCCESS，出错或超时返回 FAIL。*/
+static int tls_wait(SSL *ssl, int fd, int rc)
 {
-    char buff[1024];
+    switch (SSL_get_error(ssl, rc))
+    {
+    case SSL_ERROR_WANT_READ:
+        return (wait_fd(fd, POLLIN, IO_TIMEOUT_MS) > 0) ? SUCCESS : FAIL;
+    case SSL_ERROR_WANT_WRITE:
+        return (wait_fd(fd, POLLOUT, IO_TIMEOUT_MS) > 0) ? SUCCESS : FAIL;
+    default:
+        return FAIL;
+    }
+}
 
-    sprintf(buff, "HTTP/1.0 500 Internal Server Error\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+/* conn_recv() 的 OpenSSL 实现，返回值和 errno 与 recv() 一致（Socket 是非阻塞的）。*/
+static ssize_t tls_recv(void *ssl, void *buf, size_t len, int flags)
+{
+    int n = (flags & MSG_PEEK) ? SSL_peek(ssl, buf, len) : SSL_read(ssl, buf, len);
 
-    sprintf(buff, "Content-Type: text/html\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+    if (n > 0)
+        return n;
+    switch (SSL_get_error(ssl, n))
+    {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;  // close_notify
+    default:
+        ERR_clear_error();
+        errno = ECONNRESET;
+        return -1;
+    }
+}
 
-    sprintf(buff, "\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+static int tls_pending(void *ssl)
+{
+    return SSL_pending(ssl);
+}
 
-    sprintf(buff, "<P>Error prohibited CGI execution.\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+static int tls_write_all(SSL *ssl, int fd, const char *buf, size_t len)
+{
+    int n;
+
+    while (len > 0)
+    {
+        n = SSL_write(ssl, buf, len);
+        if (n > 0)
+        {
+            buf += n;
+            len -= n;
+        }
+        else if (FAIL == tls_wait(ssl, fd, n))
+        {
+            return FAIL;
+        }
+    }
+
+    return SUCCESS;
 }
 
 /**********************************************************************/
-/* Execute a CGI script.  Will need to set environment variables as
- * appropriate.
- * Parameters: client socket descriptor
- *             path to the CGI script */
-/**********************************************************************/
-void execute_cgi(intptr_t cli_socket_fd, const char *path,
-                 const char *method, const char *query_str)
+/* 用户态 TLS：kTLS 不可用时，通过 socketpair 把明文交给普通的处理线程，
+ * 当前线程负责 SSL_read()/SSL_write()，直到 Response 发送完毕。
+ **********************************************************************/
+static void tls_bridge(SSL *ssl, int fd)
 {
-    char buff[1024];
-    buff[0] = 'A';
-    buff[1] = '\0';
-    int num_chars = 0;
-    int content_len = -1;
+    char buff[16384];
+    struct pollfd pfds[2];
+    pthread_t thread;
+    int sv[2];
+    int client_eof = 0;
+    int n;
 
-    if (0 == strcasecmp(method, "GET"))
-    {  // GET
+    if ((FAIL == socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) || (sv[1] >= MAX_CONNS))
+        return;
 
-        /* 从 Recv buffer 中消耗完 Client Request Headers。*/
-        while ((num_chars > 0) && strcmp(buff, "\n"))
-        {
-            num_chars = get_line(cli_socket_fd, buff, sizeof(buff));
-        }
+    /* 处理线程通过 conn_table 获取 Client 地址；追踪记录在 TLS 连接上，不重复记录。*/
+    conn_table[sv[1]] = conn_table[fd];
+    conn_table[sv[1]].tls = 0;
+    conn_table[sv[1]].trace_sampled = 0;
+    conn_table[sv[1]].ssl = NULL;
+    if (pthread_create(&thread, NULL, request_thread, (void *)(intptr_t)sv[1]) != 0)
+    {
+        close(sv[0]);
+        close(sv[1]);
+        return;
     }
-    else if (0 == strcasecmp(method, "POST"))
-    {  // POST
+    pthread_detach(thread);
+    set_sock_non_blocking(sv[0]);
+
+    for ( ;; )
+    {
+        pfds[0].fd = client_eof ? -1 : fd;
+        pfds[0].events = POLLIN;
+        pfds[0].revents = 0;
+        pfds[1].fd = sv[0];
+        pfds[1].events = POLLIN;
+        pfds[1].revents = 0;
+
+        /* SSL 内部可能已经缓冲了解密后的数据，此时不能等待 Socket。*/
+        if ((client_eof || (0 == SSL_pending(ssl))) && (poll(pfds, 2, IO_TIMEOUT_MS) <= 0))
+            break;
 
-        /* 从 Recv buffer 中的 Headers 中取出 Request Body，主要是 Content-Length。*/
-        num_chars = get_line(cli_socket_fd, buff, sizeof(buff));
-        while ((num_chars > 0) && strcmp(buff,"\n"))
+        if (!client_eof && (pfds[0].revents || SSL_pending(ssl)))
         {
-            buff[15] = '\0';  // `Content-Length:` 的长度截止到 15。
-            if (0 == strcasecmp(buff, "Content-Length:"))
+            n = SSL_read(ssl, buff, sizeof(buff));
+            if (n > 0)
             {
-                content_len = atoi(&(buff[16])); // 17 开始为具体的数值。
-#ifdef DEBUG
-                printf("content length: %d", content_len);
-#endif
+                if (FAIL == send_all(sv[0], buff, n))
+                    break;
+            }
+            else if (SSL_ERROR_WANT_READ != SSL_get_error(ssl, n))
+            {
+                client_eof = 1;  // close_notify、连接断开或者 TLS 错误。
+                shutdown(sv[0], SHUT_WR);
             }
-
-            /* 从 Recv buffer 中消耗完 Client Request Headers。*/
-            num_chars = get_line(cli_socket_fd, buff, sizeof(buff));
         }
-        if (-1 == content_len)
+
+        if (pfds[1].revents)
         {
-            bad_request(cli_socket_fd);  // HTTP Request Body 中没有 Content-Length 字段
-            return;
+            n = recv(sv[0], buff, sizeof(buff), 0);
+            if ((n < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+                continue;
+            if (n <= 0)
+            {
+                SSL_shutdown(ssl);  // Response 结束，发送 close_notify。
+                break;
+            }
+            if (FAIL == tls_write_all(ssl, fd, buff, n))
+                break;
         }
     }
 
-    /* 创建 In/Out 两个 Pipe，用于父子进程间通信。*/
-    int cgi_input[2];   // 0：输出端，1：输入端。
-    int cgi_output[2];  // 0：输出端，1：输入端。
-    if (pipe(cgi_input) < 0)   // Input Pipe
+    close(sv[0]);
+}
+
+/**********************************************************************/
+/* 处理 HTTPS 连接：完成 TLS 握手后，
+ *   - 收发两个方向都启用了 kTLS：记录层的加解密完全由内核完成，Socket 可以
+ *     直接交给 request_handle()，sendfile() 和 splice() 仍然是零拷贝；
+ *   - 只有发送方向启用了 kTLS（e.g. OpenSSL 3.0/3.1 上的 TLS 1.3）：Response 仍由内核加密、
+ *     保持零拷贝，Request 通过 conn_recv() 由 OpenSSL 解密；
+ *   - 否则退回用户态 TLS，通过 tls_bridge() 转发。
+ **********************************************************************/
+void tls_serve(intptr_t cli_socket_fd)
+{
+    SSL *ssl = (NULL != tls_ctx) ? SSL_new(tls_ctx) : NULL;
+    int rc;
+
+    if ((NULL == ssl) || (1 != SSL_set_fd(ssl, cli_socket_fd)))
     {
-        cannot_execute(cli_socket_fd);
+        SSL_free(ssl);
+        close(cli_socket_fd);
         return;
     }
-    if (pipe(cgi_output) < 0)  // Output Pipe
+
+    TRACE_BEGIN(TRACE_TLS_HANDSHAKE);
+    while ((rc = SSL_accept(ssl)) != 1)
     {
-        cannot_execute(cli_socket_fd);
+        if (FAIL == tls_wait(ssl, cli_socket_fd, rc))
+            break;
+    }
+    TRACE_END(TRACE_TLS_HANDSHAKE);
+    if (1 != rc)
+    {
+        __atomic_add_fetch(&tls_failures, 1, __ATOMIC_RELAXED);
+        ERR_clear_error();
+        SSL_free(ssl);
+        close(cli_socket_fd);
         return;
     }
+    __atomic_add_fetch(&tls_handshakes, 1, __ATOMIC_RELAXED);
+    if (SSL_session_reused(ssl))
+        __atomic_add_fetch(&tls_resumed, 1, __ATOMIC_RELAXED);
 
-    /* 创建子进程，用于执行 CGI 程序。*/
-    pid_t pid;
-    if ((pid = fork()) < 0)
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl)))
     {
-        cannot_execute(cli_socket_fd);
+        /* 密钥已经交给内核，SSL 对象不再需要（SSL_set_fd() 不会关闭 fd）。*/
+        __atomic_add_fetch(&tls_ktls, 1, __ATOMIC_RELAXED);
+        SSL_free(ssl);
+        request_handle((void *)cli_socket_fd);
+        return;
+    }
+    if ((cli_socket_fd < MAX_CONNS) && BIO_get_ktls_send(SSL_get_wbio(ssl)))
+    {
+        /* request_handle() 返回时已经关闭了 fd，之后 conn_table 中的条目可能属于新的连接，
+         * 不能再访问；accept 时会重置 ssl 字段。*/
+        __atomic_add_fetch(&tls_ktls_tx, 1, __ATOMIC_RELAXED);
+        conn_table[cli_socket_fd].ssl = ssl;
+        request_handle((void *)cli_socket_fd);
+        SSL_free(ssl);
         return;
     }
 
-    sprintf(buff, "HTTP/1.0 200 OK\r\n");
-    send(cli_socket_fd, buff, strlen(buff), 0);
+    __atomic_add_fetch(&tls_userspace, 1, __ATOMIC_RELAXED);
+    tls_bridge(ssl, cli_socket_fd);
+    SSL_free(ssl);
+    close(cli_socket_fd);
+}
 
-    /*** 
-     * Pipeline 数据流：
-     *  client ->cgi_input[1] -> cgi_input[0] -> STDIN -> STDOUT -> cgi_output[1] -> cgi_output[0] -> client
-     */
-    if (0 == pid)
-    {  // 子进程
+/* 状态页面：输出 TLS 握手、Session 复用和 kTLS 的统计。*/
+void tls_status(intptr_t cli_socket_fd)
+{
+    char buff[1024];
 
-        /* 管道重定向：cgi_input[0] -> STDIN -> STDOUT -> cgi_output[1] */
-        dup2(cgi_input[0], STDIN);    // cgi_input 管道的输出端重定向到 STDIN；
-        dup2(cgi_output[1], STDOUT);  // cgi_output 管道的输入端重定向到 STDOUT；
+    snprintf(buff, sizeof(buff),
+             "handshakes=%lu resumed=%lu ktls=%lu ktls_tx=%lu userspace=%lu failures=%lu "
+             "session_cache=%ld cache_hits=%ld\n",
+             __atomic_load_n(&tls_handshakes, __ATOMIC_RELAXED),
+             __atomic_load_n(&tls_resumed, __ATOMIC_RELAXED),
+             __atomic_load_n(&tls_ktls, __ATOMIC_RELAXED),
+             __atomic_load_n(&tls_ktls_tx, __ATOMIC_RELAXED),
+             __atomic_load_n(&tls_userspace, __ATOMIC_RELAXED),
+             __atomic_load_n(&tls_failures, __ATOMIC_RELAXED),
+             tls_ctx ? SSL_CTX_sess_number(tls_ctx) : 0,
+             tls_ctx ? SSL_CTX_sess_hits(tls_ctx) : 0);
+    send_all(cli_socket_fd, buff, strlen(buff));
+}
+#endif
 
-        /* 子进程不需要 cgi_input 输入端，和 cgi_output 输出端，这两端在父进程处理。*/
-        close(cgi_input[1]);          // 关闭 cgi_input 输入端；
-        close(cgi_output[0]);         // 关闭 cgi_output 输出端；
 
-        /* 设置 CGI 程序的运行时环境变量。*/
-        char meth_env[255];
-        char query_env[255];
-        char length_env[255];
-        sprintf(meth_env, "REQUEST_METHOD=%s", method);
-        putenv(meth_env);
-        if (0 == strcasecmp(method, "GET"))
-        {
-            sprintf(query_env, "QUERY_STRING=%s", query_str);
-            putenv(query_env);
-        }
-        else
-        {
-            sprintf(length_env, "CONTENT_LENGTH=%d", content_len);
-            putenv(length_env);
-        }
 
-        // 子进程调用 path 指定的 Perl CGI 脚本程序。
-        execl(path, NULL);
-        exit(0);
-    }
-    else
-    {  // 父进程
-        char c = '\0';
+/*************************
+ * STATUS PAGES
+ *************************/
 
-        close(cgi_input[0]);
-        close(cgi_output[1]);
+/* 内部状态页面的 URL 前缀，e.g. /_status/proxy、/_status/trace。*/
+#define STATUS_URL_PREFIX "/_status/"
 
-        /* 将 POST request 通过 Pipe 传递到子进程。*/
-        if (0 == strcasecmp(method, "POST"))
-        {
-            int i;
-            for (i=0; i < content_len; i++)
-            {
-                /* 将 Client Request 以 Byte steam 的形式写入子进程。*/
-                recv(cli_socket_fd, &c, 1, 0);
-                write(cgi_input[1], &c, 1);  
-#ifdef DEBUG
-                printf("content char: %c", c);
+struct status_page
+{
+    const char *name;
+    const char *content_type;
+    void (*handler)(intptr_t cli_socket_fd);
+};
+
+static const struct status_page status_pages[] = {
+    { "proxy", "text/plain", proxy_status },
+    { "cache", "text/plain", microcache_status },
+    { "trace", "application/json", trace_status },
+    { "ratelimit", "text/plain", ratelimit_status },
+    { "cgi", "text/plain", cgi_status },
+#ifdef ENABLE_TLS
+    { "tls", "text/plain", tls_status },
 #endif
-            }
-        }
+};
+
+/* 状态页面暴露内部指标，/_status/trace 还包含完整的 URL 和 query string，默认只响应
+ * loopback Client；环境变量 HTTPD_STATUS_PUBLIC=1 时对所有 Client 开放。*/
+static int status_public;
+
+/* Client 地址是否为 loopback（127.0.0.0/8、::1 或 ::ffff:127.0.0.0/104）。
+ * TLS 桥接和 HTTP/2 Stream 的 socketpair 复制了原连接的地址。*/
+static int status_allowed(intptr_t cli_socket_fd)
+{
+    const struct conn_info *conn;
+
+    if (status_public)
+        return 1;
+    if (cli_socket_fd >= MAX_CONNS)
+        return 0;
+
+    conn = &conn_table[cli_socket_fd];
+    if (AF_INET == conn->addr.sa.sa_family)
+        return 127 == (ntohl(conn->addr.in.sin_addr.s_addr) >> 24);
+    if (AF_INET6 == conn->addr.sa.sa_family)
+        return IN6_IS_ADDR_LOOPBACK(&conn->addr.in6.sin6_addr) ||
+               (IN6_IS_ADDR_V4MAPPED(&conn->addr.in6.sin6_addr) && (127 == conn->addr.in6.sin6_addr.s6_addr[12]));
+    return 0;
+}
+
+/**********************************************************************/
+/* 响应内部状态页面请求，以 text/plain 格式输出运行时指标。
+ * 不允许访问的 Client 收到 404，与不存在的页面相同。
+ **********************************************************************/
+void serve_status(intptr_t cli_socket_fd, const char *name)
+{
+    char buff[1024];
+    size_t i;
+
+    if (!status_allowed(cli_socket_fd))
+    {
+        not_found(cli_socket_fd);
+        return;
+    }
 
-        /* 从 cgi_output 输出端口读取子进程的处理结果，然后响应到 Client。*/
-        while (read(cgi_output[0], &c, 1) > 0)
+    for (i = 0; i < sizeof(status_pages) / sizeof(status_pages[0]); i++)
+    {
+        if (0 == strcmp(name, status_pages[i].name))
         {
-            send(cli_socket_fd, &c, 1, 0);
-        }
+            sprintf(buff, "HTTP/1.0 200 OK\r\n");
+            send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
 
-        close(cgi_output[0]);
-        close(cgi_input[1]);
+            sprintf(buff, SERVER_STRING);
+            send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+
+            sprintf(buff, "Content-Type: %s\r\n", status_pages[i].content_type);
+            send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
+
+            sprintf(buff, "\r\n");
+            send(cli_socket_fd, buff, strlen(buff), MSG_NOSIGNAL);
 
-        int status;
-        waitpid(pid, &status, 0);
+            status_pages[i].handler(cli_socket_fd);
+            return;
+        }
     }
+
+    not_found(cli_socket_fd);
 }
 
 /**********************************************************************
@@ -547,6 +5667,7 @@ void request_handle(void *arg)
     char buff[1024];
 
     /* 获取 HTTP Request 的第一行。*/ 
+    TRACE_BEGIN(TRACE_READ_REQUEST);
     size_t num_chars;  // 第一行的字符数量
     num_chars = get_line(cli_socket_fd, buff, sizeof(buff));
 #ifdef DEBUG
@@ -559,6 +5680,21 @@ num_chars: 15
      */
 #endif
 
+    /* HTTP/2 prior knowledge：Client Preface 的第一行 PRI * HTTP/2.0，剩余部分是 \r\n、SM\r\n、\r\n。*/
+    if (0 == strcmp(buff, "PRI * HTTP/2.0\n"))
+    {
+        TRACE_END(TRACE_READ_REQUEST);
+        if ((1 == get_line(cli_socket_fd, buff, sizeof(buff))) &&
+            (0 == strcmp(buff, "\n")) &&
+            (3 == get_line(cli_socket_fd, buff, sizeof(buff))) && (0 == strcmp(buff, "SM\n")) &&
+            (1 == get_line(cli_socket_fd, buff, sizeof(buff))) && (0 == strcmp(buff, "\n")))
+        {
+            h2_serve(cli_socket_fd, NULL);
+        }
+        close(cli_socket_fd);
+        return;
+    }
+
     /* 将 HTTP Method 存入 method 中。*/
     char method[255];
     size_t method_part = 0;
@@ -575,13 +5711,6 @@ method: GET
      */
 #endif
 
-    /* 如果不是 GET 也不是 POST，返回未实现。*/
-    if (strcasecmp(method, "GET") && strcasecmp(method, "POST"))
-    {
-        unimplemented(cli_socket_fd);
-        return;
-    }
-
     /* 将 HTTP URL 存入 url 中。*/
     size_t url_part = method_part;  // e.g. `/index.html`
     while (IS_SPACE(buff[url_part]) && (url_part < num_chars))  // 跳过 method 后紧跟的空字符。
@@ -604,6 +5733,93 @@ url: /index.html
      */
 #endif
 
+    /* 将 HTTP 版本存入 protocol 中，e.g. HTTP/1.1。*/
+    char protocol[16];
+    while (IS_SPACE(buff[url_part]) && (url_part < num_chars))
+    {
+        url_part++;
+    }
+    i = 0;
+    while (!IS_SPACE(buff[url_part]) && (i < sizeof(protocol) - 1) && (url_part < num_chars))
+    {
+        protocol[i++] = buff[url_part++];
+    }
+    protocol[i] = '\0';
+
+    /* 规范化 URL 的路径部分，之后所有的规则匹配和文件访问都使用规范化后的 URL。*/
+    int url_ok = (SUCCESS == normalize_url(url));
+
+    /* 读取全部 Request Headers，Body 留在 Socket Buffer 中由具体的处理函数读取。*/
+    struct http_request req;
+    snprintf(req.method, sizeof(req.method), "%s", method);
+    snprintf(req.url, sizeof(req.url), "%s", url);
+    snprintf(req.protocol, sizeof(req.protocol), "%s", protocol);
+    read_request_headers(cli_socket_fd, &req);
+    TRACE_END(TRACE_READ_REQUEST);
+    trace_set_url(req.url);
+
+    if (!url_ok)
+    {   /* 路径中含有 ".."，可能越过 htdocs 目录。*/
+        bad_request(cli_socket_fd);
+        close(cli_socket_fd);
+        return;
+    }
+
+    /* 按 Client 和 URL 前缀限流。*/
+    if ((cli_socket_fd < MAX_CONNS) && (FAIL == ratelimit_check_request(&conn_table[cli_socket_fd], url)))
+    {
+        too_many_requests(cli_socket_fd);
+        close(cli_socket_fd);
+        return;
+    }
+
+    /* h2c Upgrade：只升级没有 Body 的请求，该请求在 HTTP/2 连接中作为 Stream 1 响应。*/
+    const char *upgrade = get_header(&req, "Upgrade");
+    if ((NULL != upgrade) && strcasestr(upgrade, "h2c") && (NULL != get_header(&req, "HTTP2-Settings")) &&
+        (req.content_len <= 0) && !req.chunked)
+    {
+        const char *switching = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+        if (SUCCESS == send_all(cli_socket_fd, switching, strlen(switching)))
+            h2_serve(cli_socket_fd, &req);
+        close(cli_socket_fd);
+        return;
+    }
+
+    /* 内部状态页面，e.g. /_status/proxy。*/
+    if (0 == strncmp(url, STATUS_URL_PREFIX, strlen(STATUS_URL_PREFIX)))
+    {
+        serve_status(cli_socket_fd, url + strlen(STATUS_URL_PREFIX));
+        close(cli_socket_fd);
+        return;
+    }
+
+    /* 匹配反向代理路由的请求，转发给 upstream 处理，支持任意 method。*/
+    struct proxy_route *route = proxy_match(url);
+    if (NULL != route)
+    {
+        TRACE_BEGIN(TRACE_PROXY);
+        proxy_request(cli_socket_fd, &req, route);
+        TRACE_END(TRACE_PROXY);
+        close(cli_socket_fd);
+        return;
+    }
+
+    /* PUT，以及 POST 到上传目录：把 Request Body 写入文件。*/
+    if ((0 == strcasecmp(method, "PUT")) || ((0 == strcasecmp(method, "POST")) && is_upload_url(url)))
+    {
+        upload_handle(cli_socket_fd, &req, url);
+        close(cli_socket_fd);
+        return;
+    }
+
+    /* 如果不是 GET 也不是 POST，返回未实现。*/
+    if (strcasecmp(method, "GET") && strcasecmp(method, "POST"))
+    {
+        unimplemented(cli_socket_fd);
+        close(cli_socket_fd);
+        return;
+    }
+
     /* 针对 POST，需要开启 Perl CGI。*/
     int cgi_on = 0;
     if (0 == strcasecmp(method, "POST"))
@@ -645,15 +5861,11 @@ path: htdocs/index.html
 
     /* 获取 path 指定文件的元数据信息，并存储到 st buf 中。*/
     struct stat st;
-    if (-1 == stat(path, &st)) 
+    TRACE_BEGIN(TRACE_STAT);
+    int stat_rc = stat(path, &st);
+    TRACE_END(TRACE_STAT);
+    if (-1 == stat_rc)
     {   /* 没有找到文件，返回 404。*/
-
-        /* 从 Recv buffer 中消耗完 Client Request Headers。*/
-        while ((num_chars > 0) && strcmp("\n", buff))
-        {
-            num_chars = get_line(cli_socket_fd, buff, sizeof(buff));
-        }
-        /* 返回 404。*/
         not_found(cli_socket_fd);
     }
     else
@@ -682,7 +5894,11 @@ path: htdocs/index.html
 #ifdef DEBUG
             printf("Execute CGI: %s\n.", path);
 #endif
-            execute_cgi(cli_socket_fd, path, method, query_str);
+            const struct microcache_rule *rule = microcache_match(url, &req);
+            if (NULL != rule)
+                microcache_serve(cli_socket_fd, &req, rule, path, query_str);
+            else
+                execute_cgi(cli_socket_fd, &req, path, query_str);
         }
     }
 
@@ -696,6 +5912,23 @@ path: htdocs/index.html
  * MAIN
  *************************/
 
+/* 处理线程入口：追踪被采样的请求，并调用 request_handle() 处理。*/
+static void *request_thread(void *arg)
+{
+    struct trace_ctx trace;
+
+    trace_request_begin(&trace, (int)(intptr_t)arg);
+#ifdef ENABLE_TLS
+    if (((intptr_t)arg < MAX_CONNS) && conn_table[(intptr_t)arg].tls)
+        tls_serve((intptr_t)arg);
+    else
+#endif
+    request_handle(arg);
+    trace_request_end();
+
+    return NULL;
+}
+
 /* 设置 Socket 为非阻塞 I/O 模式。*/
 static int set_sock_non_blocking(int sock_fd)
 {
@@ -722,6 +5955,38 @@ int main(void)
     
     u_short port = 8086;  // 自定义 Socket 端口。
     int srv_socket_fd = startup_tcp_socket(port);
+
+    /* Client 或 upstream 提前关闭连接时，send() 返回 EPIPE 而不是终止进程。*/
+    signal(SIGPIPE, SIG_IGN);
+
+    /* 请求追踪采样率：每 N 个请求采样 1 个。*/
+    if (NULL != getenv("HTTPD_TRACE_SAMPLE"))
+        trace_sample_rate = atoi(getenv("HTTPD_TRACE_SAMPLE"));
+
+    /* 状态页面默认只对 loopback Client 开放。*/
+    if (NULL != getenv("HTTPD_STATUS_PUBLIC"))
+        status_public = atoi(getenv("HTTPD_STATUS_PUBLIC"));
+
+    /* SIGUSR1 导出追踪记录。在创建任何线程之前屏蔽该信号，改由 epoll 监听 signalfd，
+     * 这样信号只会在 main() 的事件循环中被处理。*/
+    sigset_t sig_mask;
+    sigemptyset(&sig_mask);
+    sigaddset(&sig_mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sig_mask, NULL);
+    int sig_fd = signalfd(-1, &sig_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (FAIL == sig_fd)
+    {
+        error_msg("signalfd");
+    }
+
+    /* 初始化反向代理路由和 upstream 健康检查。*/
+    proxy_init();
+
+    /* 生成限流使用的 429 Response。*/
+    ratelimit_init();
+
+    /* 创建上传目录，已存在时忽略。*/
+    mkdir(UPLOAD_DIR, 0755);
     
     /* 设置 Server Socket fd 为非阻塞模式。*/
     if (FAIL == set_sock_non_blocking(srv_socket_fd))
@@ -748,18 +6013,52 @@ int main(void)
     {
         error_msg("epoll_ctl");
     }
+    // 将 signalfd 添加到 epoll 实例的监听列表中。
+    event.data.fd = sig_fd;
+    event.events = EPOLLIN;
+    if (FAIL == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sig_fd, &event))
+    {
+        error_msg("epoll_ctl");
+    }
+
+    /* CGI 公共环境变量；CGI 子进程的 pidfd 也注册到这个 epoll 实例中回收。*/
+    cgi_init(epoll_fd, port);
+
+    /* HTTPS 监听端口，证书和私钥不可用时只提供 HTTP 服务。*/
+    int tls_socket_fd = -1;
+#ifdef ENABLE_TLS
+    if (SUCCESS == tls_init())
+    {
+        tls_socket_fd = startup_tcp_socket(TLS_PORT);
+        set_sock_non_blocking(tls_socket_fd);
+        event.data.fd = tls_socket_fd;
+        event.events = EPOLLIN | EPOLLET;
+        if (FAIL == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, tls_socket_fd, &event))
+        {
+            error_msg("epoll_ctl");
+        }
+        printf("httpd running on port %d (TLS)\n", TLS_PORT);
+    }
+    else
+    {
+        printf("TLS disabled: cannot load %s / %s\n", TLS_CERT_FILE, TLS_KEY_FILE);
+    }
+#endif
 
     printf("httpd running on port %d\n", port);
+    if (trace_sample_rate > 0)
+        printf("tracing 1/%d requests, dump with SIGUSR1 or /_status/trace\n", trace_sample_rate);
     int i, event_cnt;
     while (1)
     {
         /* epoll 实例开始等待事件，一次最多可返回 MAX_EVENTS 个事件，并存放到 events 容器中。*/
-        event_cnt = epoll_wait(epoll_fd, events, 64, -1);
+        event_cnt = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
         for (i = 0; i < event_cnt; ++i)
         {
             /* Server Socket fd 有可读事件，表示有 Client 发起了连接请求。*/
-            if (srv_socket_fd == events[i].data.fd)
+            if ((srv_socket_fd == events[i].data.fd) || (tls_socket_fd == events[i].data.fd))
             {
+                int listen_fd = events[i].data.fd;
                 printf("Accepted client connection request.\n");
                 for ( ;; )
                 {
@@ -769,7 +6068,8 @@ int main(void)
                     int cli_sockaddr_len = sizeof(cli_sock_addr);
 
                     int cli_socket_fd = 0;
-                    if (FAIL == (cli_socket_fd = accept(srv_socket_fd,
+                    long long accept_begin_ns = now_ns();
+                    if (FAIL == (cli_socket_fd = accept(listen_fd,
                                                         (struct sockaddr *)(&cli_sock_addr),  // 填充 Client Sock 信息。
                                                         (socklen_t *)&cli_sockaddr_len)))
                     {
@@ -788,6 +6088,40 @@ int main(void)
                     else
                         printf("Accepted connection on descriptor %d\n", cli_socket_fd);
 
+                    /* 记录 Client 地址，供 X-Forwarded-For 等使用。*/
+                    if (cli_socket_fd < MAX_CONNS)
+                    {
+                        memcpy(&conn_table[cli_socket_fd].addr, &cli_sock_addr, cli_sockaddr_len);
+                        conn_table[cli_socket_fd].addr_len = cli_sockaddr_len;
+                        conn_table[cli_socket_fd].tls = (tls_socket_fd == listen_fd);
+                        conn_table[cli_socket_fd].https = conn_table[cli_socket_fd].tls;
+                        conn_table[cli_socket_fd].ssl = NULL;
+
+                        /* 决定是否追踪此连接上的请求。*/
+                        conn_table[cli_socket_fd].trace_sampled = trace_should_sample();
+                        if (conn_table[cli_socket_fd].trace_sampled)
+                        {
+                            conn_table[cli_socket_fd].accept_begin_ns = accept_begin_ns;
+                            conn_table[cli_socket_fd].accept_end_ns = now_ns();
+                        }
+
+                        /* 连接级限流：超出限制的 Client 直接收到 429，不会占用处理线程。
+                         * 先读走已经到达的 Request，避免带着未读数据 close() 触发 RST 导致 429 丢失。
+                         * HTTPS 连接还没有握手，无法发送 429，直接关闭。*/
+                        if (FAIL == ratelimit_check_conn(&conn_table[cli_socket_fd]))
+                        {
+                            char discard[4096];
+                            if (!conn_table[cli_socket_fd].tls)
+                            {
+                                recv(cli_socket_fd, discard, sizeof(discard), MSG_DONTWAIT);
+                                too_many_requests(cli_socket_fd);
+                            }
+                            close(cli_socket_fd);
+                            continue;
+                        }
+                        conn_table[cli_socket_fd].ratelimit_charged = 1;
+                    }
+
                     /* 设置 Client Socket 为非阻塞 I/O 模式。*/
                     if (FAIL == set_sock_non_blocking(cli_socket_fd))
                     {
@@ -798,7 +6132,8 @@ int main(void)
 
                     /* 将 Client Socket fd 添加到 epoll 实例的监听列表中 */
                     event.data.fd = cli_socket_fd;
-                    event.events = EPOLLIN | EPOLLET;  // 设定可读监听事件，并采用 ET 模式。
+                    event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;  // 设定可读监听事件，并采用 ET 模式。
+                                                                     // EPOLLONESHOT：连接交给处理线程后不再触发，避免 Body 陆续到达时重复创建线程。
                     if (-1 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cli_socket_fd, &event))  // 添加 Client Socket fd 及其监听事件。
                     {
                         error_msg("epoll_ctl");
@@ -808,19 +6143,39 @@ int main(void)
                 }
             }
 
+            /* signalfd 可读，表示收到了 SIGUSR1，导出追踪记录。*/
+            else if (sig_fd == events[i].data.fd)
+            {
+                struct signalfd_siginfo si;
+                while (sizeof(si) == read(sig_fd, &si, sizeof(si)))
+                {
+                    trace_dump_file();
+                }
+            }
+
+            /* CGI 子进程的 pidfd 可读，表示子进程已经退出。*/
+            else if ((events[i].data.fd < MAX_CONNS) && conn_table[events[i].data.fd].cgi_pid)
+            {
+                cgi_reaped(events[i].data.fd);
+            }
+
             /* 发生了数据等待读取事件。因为 epoll 实例正在使用 ET 模式，所以必须完全读取所有可用数据，否则不会再次收到相同数据的通知。*/
             else if (events[i].events & EPOLLIN)
             {
                 pthread_t newthread;
                 int cli_socket_fd = events[i].data.fd;
 
+                if ((cli_socket_fd < MAX_CONNS) && conn_table[cli_socket_fd].trace_sampled)
+                    conn_table[cli_socket_fd].dispatch_ns = now_ns();
+
                 if (pthread_create(&newthread,
                                    NULL,
-                                   (void *)request_handle,
+                                   request_thread,
                                    (void *)(intptr_t)cli_socket_fd) != 0)
                 {
                     error_msg("pthread create failed");
                 }
+                pthread_detach(newthread);  // 处理线程结束后自动回收资源。
             }
             /* 发生了 epoll 异常事件，直接关闭 Client Socket fd。*/
             else if ((events[i].events & EPOLLERR) || (events[i].events & EPOLLHUP) || (!(events[i].events & EPOLLIN))) {